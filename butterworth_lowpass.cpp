@@ -1,5 +1,16 @@
 // Example : apply butterworth low pass filtering to input image/video
 // usage: prog {<image_name> | <video_name>}
+// (press "s" to toggle the spectrum display, "x" to exit)
+
+// Further filters (high-pass, band-pass / reject, notch, gaussian) can be
+// switched on from the trackbars of the filter window - all the filters
+// selected are composed into one filter (see FrequencyFilterChain), so each
+// frame still needs only one DFT, one multiply and one inverse DFT.
+
+// The "Colour" trackbar filters in colour - 1 : the B, G and R planes each
+// (sharing one filter, concurrently when built with OpenMP as in CMakeLists.txt),
+// 2 : YCrCb with the chroma planes filtered at reduced resolution (see
+// frequency_filter_colour()).
 
 // Author : Toby Breckon, toby.breckon@cranfield.ac.uk
 
@@ -17,6 +28,8 @@
 #include <string>		// standard C++ I/O
 #include <algorithm>    // includes max()
 
+#include "frequency_filter.hpp" // butterworth filters + filter bank + DFT display
+
 using namespace cv; // OpenCV API is in the C++ "cv" namespace
 using namespace std;
 
@@ -31,138 +44,6 @@ using namespace std;
 #else
 	#define CAMERA_INDEX -1
 #endif
-/******************************************************************************/
-// Rearrange the quadrants of a Fourier image so that the origin is at
-// the image center
-
-void shiftDFT(Mat& fImage )
-{
-  	Mat tmp, q0, q1, q2, q3;
-
-	// first crop the image, if it has an odd number of rows or columns
-
-	fImage = fImage(Rect(0, 0, fImage.cols & -2, fImage.rows & -2));
-
-	int cx = fImage.cols/2;
-	int cy = fImage.rows/2;
-
-	// rearrange the quadrants of Fourier image
-	// so that the origin is at the image center
-
-	q0 = fImage(Rect(0, 0, cx, cy));
-	q1 = fImage(Rect(cx, 0, cx, cy));
-	q2 = fImage(Rect(0, cy, cx, cy));
-	q3 = fImage(Rect(cx, cy, cx, cy));
-
-	q0.copyTo(tmp);
-	q3.copyTo(q0);
-	tmp.copyTo(q3);
-
-	q1.copyTo(tmp);
-	q2.copyTo(q1);
-	tmp.copyTo(q2);
-}
-
-/******************************************************************************/
-// return a floating point spectrum magnitude image scaled for user viewing
-// complexImg- input dft (2 channel floating point, Real + Imaginary fourier image)
-// rearrange - perform rearrangement of DFT quadrants if true
-
-// return value - pointer to output spectrum magnitude image scaled for user viewing
-
-Mat create_spectrum_magnitude_display(Mat& complexImg, bool rearrange)
-{
-    Mat planes[2];
-
-    // compute magnitude spectrum (N.B. for display)
-    // compute log(1 + sqrt(Re(DFT(img))**2 + Im(DFT(img))**2))
-
-    split(complexImg, planes);
-    magnitude(planes[0], planes[1], planes[0]);
-
-    Mat mag = (planes[0]).clone();
-    mag += Scalar::all(1);
-    log(mag, mag);
-
-    if (rearrange)
-    {
-        // re-arrange the quaderants
-        shiftDFT(mag);
-    }
-
-    normalize(mag, mag, 0, 1, NORM_MINMAX);
-
-    return mag;
-
-}
-/******************************************************************************/
-
-// create a 2-channel butterworth low-pass filter with radius D, order n
-// (assumes pre-aollocated size of dft_Filter specifies dimensions)
-
-// void create_butterworth_lowpass_filter(Mat &dft_Filter, int D, int n)
-// {
-// 	Mat tmp = Mat(dft_Filter.rows, dft_Filter.cols, CV_32F);
-//
-// 	Point centre = Point(dft_Filter.rows / 2, dft_Filter.cols / 2);
-// 	double radius;
-//
-// 	// based on the forumla in the IP notes (p. 130 of 2009/10 version)
-// 	// see also HIPR2 on-line
-//
-// 	for(int i = 0; i < dft_Filter.rows; i++)
-// 	{
-// 		for(int j = 0; j < dft_Filter.cols; j++)
-// 		{
-// 			radius = (double) sqrt(pow((i - centre.x), 2.0) + pow((double) (j - centre.y), 2.0));
-// 			tmp.at<float>(i,j) = (float)
-// 						( 1 / (1 + pow((double) (radius /  D), (double) (2 * n))));
-// 		}
-// 	}
-//
-//     Mat toMerge[] = {tmp, tmp};
-// 	merge(toMerge, 2, dft_Filter);
-// }
-
-// improved version thanks to: James Freeman, GP2U
-
-// fix 1: rows (y) and the cols (x) transposed which then leads on to  confusing
-// comparison of i (y axis) to centre.x and j (x axis) to centre.y
-// fix 2: doesn't work if dftFilter is even size (in above version)
-// fix 3: Creating one quadrant correctly and then flipping it into the other
-// 3 quadrants also saves 75% of the pow/sqrt calls and speeds it up by ~70%
-
-void create_butterworth_lowpass_filter(Mat& dftFilter, int radius, int order)
-{
-    Mat tmp = Mat(dftFilter.rows, dftFilter.cols, CV_32F);
-
-    int cy = dftFilter.rows / 2;
-    int cx = dftFilter.cols / 2;
-    Mat q0 = tmp(Rect(0, 0, cx, cy));
-    Mat q1 = tmp(Rect(cx, 0, cx, cy));
-    Mat q2 = tmp(Rect(0, cy, cx, cy));
-    Mat q3 = tmp(Rect(cx, cy, cx, cy));
-
-    // _create one quadrant...
-    for (int yi = 0; yi < cy; yi++)
-        for (int xi = 0; xi < cx; xi++)
-            q3.at<float>(yi, xi) = (1.0 / (1 + pow((cv::sqrt(yi * yi + xi * xi) / radius), order)));
-
-    // now flip into place to _create the rest of filter
-
-    flip(q3, q1, 0);
-    flip(q3, q2, 1);
-    flip(q3, q0, -1);
-
-    // to multiply a DFT image by a filter, this filter 
-    // should be real only, otherwise the multiplication 
-    // changes the phase along with the magnitude of each 
-    // pixel in the DFT - bug fix, 01/2023 - https://github.com/epitalon
-
- 	Mat toMerge[] = { tmp, Mat::zeros(tmp.size(), CV_32F) };
-    merge(toMerge, 2, dftFilter);
-}
-
 /******************************************************************************/
 
 int main( int argc, char** argv )
@@ -172,17 +53,35 @@ int main( int argc, char** argv )
   VideoCapture cap; // capture object
 
   Mat padded;		// fourier image objects and arrays
-  Mat complexImg, filter, filterOutput;
-  Mat planes[2], mag;
+  Mat realImg, spectrum, filter, filterOutput; // (spectrum - packed CCS, see frequency_filter.hpp)
+  FrequencyFilterBank filterBank; // filters cached by (DFT size, filter chain)
+  FrequencyFilterChain chain;     // filters selected on the trackbars
+  Mat filterShown;                // filter currently shown in the filter window
+  Mat mag, magScratch;            // spectrum display (+ its working rows, reused)
 
   int N, M; // fourier image sizes
 
   int radius = 30;				// low pass filter parameter
-  int order = 2;				// low pass filter parameter
+  int order = 2;				// low pass filter parameter (all butterworth filters)
+
+  int lowPass = 1;              // low pass : 0 - off, 1 - butterworth, 2 - gaussian
+  int highPass = 0;             // high pass : 0 - off, 1 - butterworth, 2 - gaussian
+  int highPassRadius = 5;
+  int band = 0;                 // band : 0 - off, 1 - band pass, 2 - band reject
+  int bandRadius = 40;
+  int bandWidth = 10;
+  int notch = 0;                // notch reject : 0 - off, 1 - on
+  int notchU = 0;               // notch frequency (rows, cols of the DFT)
+  int notchV = 20;
+  int notchRadius = 5;
+
+  int colour = 0;               // 0 - grayscale, 1 - BGR planes, 2 - YCrCb (reduced chroma)
 
-  const string originalName = "Input Image (grayscale)"; // window name
+  bool showSpectrum = true;		// spectrum display on / off (toggled with "s")
+
+  const string originalName = "Input Image"; // window name
   const string spectrumMagName = "Magnitude Image (log transformed)"; // window name
-  const string lowPassName = "Butterworth Low Pass Filtered (grayscale)"; // window name
+  const string lowPassName = "Butterworth Low Pass Filtered"; // window name
   const string filterName = "Filter Image"; // window nam
 
   bool keepProcessing = true;	// loop control flag
@@ -233,6 +132,20 @@ int main( int argc, char** argv )
 
       createTrackbar("Radius", lowPassName, &radius, (min(M, N) / 2));
 	  createTrackbar("Order", lowPassName, &order, 10);
+	  createTrackbar("Colour", lowPassName, &colour, 2);
+
+      // further filters to compose with (or instead of) the low pass filter
+
+      createTrackbar("Low Pass", filterName, &lowPass, 2);
+      createTrackbar("High Pass", filterName, &highPass, 2);
+      createTrackbar("HP Radius", filterName, &highPassRadius, (min(M, N) / 2));
+      createTrackbar("Band", filterName, &band, 2);
+      createTrackbar("Band Radius", filterName, &bandRadius, (min(M, N) / 2));
+      createTrackbar("Band Width", filterName, &bandWidth, (min(M, N) / 2));
+      createTrackbar("Notch", filterName, &notch, 1);
+      createTrackbar("Notch U", filterName, &notchU, M / 2);
+      createTrackbar("Notch V", filterName, &notchV, N / 2);
+      createTrackbar("Notch Radius", filterName, &notchRadius, (min(M, N) / 2));
 
 	  // start main loop
 
@@ -260,57 +173,111 @@ int main( int argc, char** argv )
 
 		  // ***
 
-		    // convert input to grayscale
-
-		  	cvtColor(img, imgGray, COLOR_BGR2GRAY);
-
-			// setup the DFT images
-
-	  		copyMakeBorder(imgGray, padded, 0, M - imgGray.rows, 0,
-			      N - imgGray.cols, BORDER_CONSTANT, Scalar::all(0));
-	  		planes[0] = Mat_<float>(padded);
-		    planes[1] = Mat::zeros(padded.size(), CV_32F);
-
-	  		merge(planes, 2, complexImg);
-
-			// do the DFT
-
-		    dft(complexImg, complexImg);
-
-		    // construct the filter (same size as complex image)
-
-		    filter = complexImg.clone();
-		    create_butterworth_lowpass_filter(filter, radius, order);
-
-		    // apply filter
-		    shiftDFT(complexImg);
-            mulSpectrums(complexImg, filter, complexImg, 0);
-            shiftDFT(complexImg);
-
-			// create magnitude spectrum for display
-
-		    mag = create_spectrum_magnitude_display(complexImg, true);
-
-            // do inverse DFT on filtered image
-
-            idft(complexImg, complexImg);
-
-            // split into planes and extract plane 0 as output image
-
-            split(complexImg, planes);
-            normalize(planes[0], imgOutput, 0, 1, NORM_MINMAX);
-
-            // do the same with the filter image
-
-            split(filter, planes);
-            normalize(planes[0], filterOutput, 0, 1, NORM_MINMAX);
+		    // compose the filters selected on the trackbars
+
+		    chain.clear();
+		    if (lowPass)
+		    {
+		        chain.add(FrequencyFilterStage((lowPass == 1) ? FREQUENCY_LOWPASS : FREQUENCY_GAUSSIAN_LOWPASS,
+		                                       radius, order));
+		    }
+		    if (highPass)
+		    {
+		        chain.add(FrequencyFilterStage((highPass == 1) ? FREQUENCY_HIGHPASS : FREQUENCY_GAUSSIAN_HIGHPASS,
+		                                       highPassRadius, order));
+		    }
+		    if (band)
+		    {
+		        chain.add(FrequencyFilterStage((band == 1) ? FREQUENCY_BANDPASS : FREQUENCY_BANDREJECT,
+		                                       bandRadius, order, bandWidth));
+		    }
+		    if (notch)
+		    {
+		        chain.add(FrequencyFilterStage(FREQUENCY_NOTCH, notchRadius, order, 0, notchU, notchV));
+		    }
+
+		    // get the filter (product of the chain, same size + packed layout as
+		    // the spectrum) - only rebuilt when the DFT size or one of the
+		    // filters has changed since it was last used
+
+		    int64 misses = filterBank.misses();
+		    filter = filterBank.get(chain, Size(N, M), CV_32F);
+		    if (filterBank.misses() != misses)
+		    {
+		        std::cout << "filter rebuilt (" << chain.size() << " filters composed) - bank hits "
+		                  << filterBank.hits() << " / misses " << filterBank.misses() << std::endl;
+		    }
+
+		    // filter image for display (centred) - only when the filter changes
+
+		    if (filter.data != filterShown.data)
+		    {
+		        filterShown = filter;
+		        ccs_magnitude(filter, filterOutput);
+		        shiftDFT(filterOutput);
+		        normalize(filterOutput, filterOutput, 0, 1, NORM_MINMAX);
+		    }
+
+		    bool spectrumVisible = showSpectrum &&
+		                           (getWindowProperty(spectrumMagName, WND_PROP_VISIBLE) > 0);
+
+		    if (colour)
+		    {
+		        // colour - all three planes filtered with the same (cached) filter
+		        // (B or luma plane spectrum returned for the display)
+
+		        imgGray = img;
+		        frequency_filter_colour(img, imgOutput, chain, filterBank,
+		                                (colour == 1) ? FREQUENCY_COLOUR_BGR : FREQUENCY_COLOUR_YCRCB,
+		                                spectrumVisible ? &spectrum : NULL);
+		        if (spectrumVisible)
+		        {
+		            spectrum_log_magnitude(spectrum, mag, magScratch, true);
+		        }
+		    } else {
+
+		        // convert input to grayscale
+
+		        cvtColor(img, imgGray, COLOR_BGR2GRAY);
+
+		        // setup the DFT images
+
+		        copyMakeBorder(imgGray, padded, 0, M - imgGray.rows, 0,
+		              N - imgGray.cols, BORDER_CONSTANT, Scalar::all(0));
+		        padded.convertTo(realImg, CV_32F);
+
+		        // do the DFT (real input - packed CCS spectrum)
+
+		        dft(realImg, spectrum);
+
+		        // apply filter (all the filters at once - the packed filter is not
+		        // centred, so no shiftDFT())
+
+		        mulSpectrums(spectrum, filter, spectrum, 0);
+
+		        // create magnitude spectrum for display - only if its window is
+		        // actually visible (fused log magnitude + rearrangement, display only)
+
+		        if (spectrumVisible)
+		        {
+		            spectrum_log_magnitude(spectrum, mag, magScratch, true);
+		        }
+
+		        // do inverse DFT on filtered image (real output)
+
+		        idft(spectrum, imgOutput, DFT_REAL_OUTPUT);
+		        normalize(imgOutput, imgOutput, 0, 1, NORM_MINMAX);
+		    }
 
 		  // ***
 
 		  // display image in window
 
 		  imshow(originalName, imgGray);
-		  imshow(spectrumMagName, mag);
+		  if (spectrumVisible)
+		  {
+		      imshow(spectrumMagName, mag);
+		  }
 		  imshow(lowPassName, imgOutput);
 		  imshow(filterName, filterOutput);
 
@@ -332,6 +299,18 @@ int main( int argc, char** argv )
 				  		  << std::endl;
 	   			keepProcessing = false;
 		  }
+		  else if (key == 's'){
+
+			// if user presses "s" then toggle the spectrum display
+
+			  	showSpectrum = !showSpectrum;
+			  	if (showSpectrum)
+			  	{
+			  	    namedWindow(spectrumMagName, 0);
+			  	} else {
+			  	    destroyWindow(spectrumMagName);
+			  	}
+		  }
 	  }
 
 	  // the camera will be deinitialized automatically in VideoCapture destructor
@@ -0,0 +1,234 @@
+// Example : streaming (out of core) Butterworth low pass filtering of very large
+// images using the tiled (overlap-save) FFT engine
+// usage: prog [--check] <input.pgm> <output.pgm> [<radius> <order> [<band_rows>]]
+
+// The Butterworth transfer function is turned into a spatial kernel once (see
+// frequency_filter_kernel()) and the image is then convolved with it tile by
+// tile - each tile a small DFT sized for cache, tiles filtered in parallel -
+// while being read, filtered and written in horizontal bands, so neither a
+// whole image DFT nor the whole image need ever fit in memory. radius is given
+// (as in butterworth_lowpass.cpp) in units of the whole image DFT. Input /
+// output are binary PGM (P5, grayscale) files, 8 or 16-bit.
+
+// --check (small images only, as it loads the whole image) then also filters
+// the image in memory and prints the max abs differences between: the streamed
+// output file and the in memory tiled result; the tiled result and the same
+// truncated kernel applied with one whole image DFT (applyMonolithic() - the
+// engine itself); and the tiled result and the whole image Butterworth filter
+// of butterworth_lowpass.cpp (circular, full DFT grid, untruncated filter),
+// the latter on the interior, at least the kernel radius away from the borders
+// where the two differ in border handling - what is left there is the error
+// of the kernel truncation.
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#include "opencv2/core.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <string>		// standard C++ I/O
+#include <vector>		// standard C++ containers
+#include <cstdlib>      // includes atoi()
+
+#include "frequency_filter.hpp" // TiledFrequencyFilter + Butterworth filter
+#include "pnm_stream.hpp"       // PNMReader / PNMWriter / PNMProgressSink
+
+using namespace cv; // OpenCV API is in the C++ "cv" namespace
+using namespace std;
+
+/******************************************************************************/
+
+#define CHECK_MAX_PIXELS (4096 * 4096)  // largest image --check will load
+
+// read a whole PNM image into memory
+
+static bool readWhole(const string& filename, Mat& img)
+{
+    PNMReader reader;
+    return reader.open(filename) && reader.read(img, reader.rows());
+}
+
+// Butterworth low pass filtering of src as butterworth_lowpass.cpp does it -
+// zero padded to the optimal DFT size, one multiply with the (untruncated)
+// filter, inverse DFT (scaled, float output)
+
+static void butterworthWholeImage(const Mat& src, Mat& dest, int radius, int order)
+{
+    const int M = getOptimalDFTSize(src.rows);
+    const int N = getOptimalDFTSize(src.cols);
+
+    Mat padded, spectrum;
+    copyMakeBorder(src, padded, 0, M - src.rows, 0, N - src.cols, BORDER_CONSTANT, Scalar::all(0));
+    padded.convertTo(padded, CV_32F);
+    dft(padded, spectrum);
+
+    Mat filter(M, N, CV_32F);
+    create_butterworth_lowpass_filter_ccs(filter, radius, order);
+    mulSpectrums(spectrum, filter, spectrum, 0);
+
+    idft(spectrum, padded, DFT_REAL_OUTPUT | DFT_SCALE);
+    padded(Rect(0, 0, src.cols, src.rows)).copyTo(dest);
+}
+
+// max abs differences between the streamed output (output), the tiled engine,
+// the same kernel with one whole image DFT and the whole image Butterworth
+// filter for the image in input
+
+static bool checkEquivalence(const TiledFrequencyFilter& filter, const string& input,
+                             const string& output, int radius, int order)
+{
+    Mat src, streamed, tiled, monolithic, butterworth, tiledOut;
+    if (!readWhole(input, src) || !readWhole(output, streamed)) return false;
+
+    int64 pre = getTickCount();
+    filter.apply(src, tiled, CV_32F);
+    double tTiled = 1000.0 * (getTickCount() - pre) / getTickFrequency();
+
+    pre = getTickCount();
+    filter.applyMonolithic(src, monolithic, CV_32F);
+    double tMonolithic = 1000.0 * (getTickCount() - pre) / getTickFrequency();
+
+    pre = getTickCount();
+    butterworthWholeImage(src, butterworth, radius, order);
+    double tButterworth = 1000.0 * (getTickCount() - pre) / getTickFrequency();
+
+    tiled.convertTo(tiledOut, src.depth());
+
+    std::cout << "check: tiled " << tTiled << " ms, kernel whole image DFT " << tMonolithic
+              << " ms, Butterworth whole image DFT " << tButterworth << " ms" << std::endl
+              << "check: max abs difference streamed vs. tiled: "
+              << norm(streamed, tiledOut, NORM_INF) << std::endl
+              << "check: max abs difference tiled vs. kernel whole image DFT: "
+              << norm(tiled, monolithic, NORM_INF) << std::endl;
+
+    // interior - at least the kernel radius from every border
+
+    const int R = filter.radius();
+    if ((src.rows > 2 * R) && (src.cols > 2 * R))
+    {
+        const Rect interior(R, R, src.cols - 2 * R, src.rows - 2 * R);
+        std::cout << "check: max abs difference tiled vs. Butterworth whole image DFT (interior "
+                  << interior.width << " x " << interior.height << "): "
+                  << norm(tiled(interior), butterworth(interior), NORM_INF) << std::endl;
+    } else {
+        std::cout << "check: image too small (kernel radius " << R
+                  << ") for an interior comparison with the Butterworth whole image DFT" << std::endl;
+    }
+    return true;
+}
+
+/******************************************************************************/
+
+int main( int argc, char** argv )
+{
+    int radius = 30;
+    int order = 2;
+    int bandRows = 256;
+    bool check = false;
+
+    // positional arguments (anything but --check)
+
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        if (string(argv[i]) == "--check")
+        {
+            check = true;
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() < 2)
+    {
+        std::cout << "usage: " << argv[0]
+                  << " [--check] <input.pgm> <output.pgm> [<radius> <order> [<band_rows>]]" << std::endl;
+        return -1;
+    }
+    if (args.size() >= 4)
+    {
+        radius = max(1, atoi(args[2].c_str()));
+        order = max(1, atoi(args[3].c_str()));
+    }
+    if (args.size() >= 5)
+    {
+        bandRows = max(1, atoi(args[4].c_str()));
+    }
+
+    PNMReader in;
+    if (!in.open(args[0]) || (CV_MAT_CN(in.type()) != 1))
+    {
+        std::cerr << "ERROR: cannot read binary PGM (8 / 16-bit) image " << args[0] << std::endl;
+        return -1;
+    }
+    PNMWriter writer;
+    if (!writer.open(args[1], in.rows(), in.cols(), in.type(), in.maxValue()))
+    {
+        std::cerr << "ERROR: cannot write image " << args[1] << std::endl;
+        return -1;
+    }
+
+    // kernel of the filter butterworth_lowpass.cpp would apply to the whole
+    // image (radius relative to its DFT size)
+
+    int64 pre = getTickCount();
+
+    Mat kernel;
+    if (!frequency_filter_kernel(kernel, Size(getOptimalDFTSize(in.cols()), getOptimalDFTSize(in.rows())),
+                                 ButterworthLowpass(radius, order)))
+    {
+        std::cerr << "WARNING: impulse response does not fit the image, kernel truncated to "
+                  << kernel.cols << " x " << kernel.rows << " (output differs from a whole image DFT filter)"
+                  << std::endl;
+    }
+    TiledFrequencyFilter filter;
+    filter.setKernel(kernel);
+
+    const int band = min(bandRows, in.rows());
+    std::cout << "image: " << in.cols() << " x " << in.rows()
+              << ", kernel " << kernel.cols << " x " << kernel.rows
+              << " (" << 1000.0 * (getTickCount() - pre) / getTickFrequency() << " ms)"
+              << ", tiles " << filter.tileSize() << " x " << filter.tileSize()
+              << ", bands of " << band << " rows" << std::endl;
+
+    PNMProgressSink out(writer, in.rows());
+
+    pre = getTickCount();
+    bool readOk = filter.applyStream(in, out, bandRows);
+    double t = (getTickCount() - pre) / getTickFrequency();
+
+    std::cout << std::endl << "Butterworth (tiled, streaming) time: " << 1000.0 * t << " ms ("
+              << (double) in.rows() * in.cols() / (1000000.0 * t) << " MPix/s)" << std::endl;
+
+    if (!readOk)
+    {
+        std::cerr << "ERROR: failed reading " << args[0] << std::endl;
+        return -1;
+    }
+    if (!out.ok || (writer.rowsWritten() != in.rows()))
+    {
+        std::cerr << "ERROR: failed writing " << args[1] << std::endl;
+        return -1;
+    }
+    writer.close();
+
+    if (check)
+    {
+        if ((int64) in.rows() * in.cols() > CHECK_MAX_PIXELS)
+        {
+            std::cerr << "check: image too large to load (max " << CHECK_MAX_PIXELS << " pixels)" << std::endl;
+        }
+        else if (!checkEquivalence(filter, args[0], args[1], radius, order))
+        {
+            std::cerr << "ERROR: check failed to re-read " << args[0] << " / " << args[1] << std::endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+/******************************************************************************/
@@ -0,0 +1,431 @@
+// Example : headless benchmark suite for image denoising filters
+// usage: prog [options] [<image_name>]
+
+// Sweeps image sizes, thread counts, noise levels and window sizes over the
+// nlm.hpp nonlocalMeansFilter() / nonlocalMeansFilterAggregate(), OpenCV fastNlMeansDenoising(Colored)(),
+// GaussianBlur(), medianBlur() and bilateralFilter() and reports, for each
+// configuration, the median / 95th percentile latency, throughput (MPix/s) and
+// the PSNR / SSIM of the result against the noise free image. Results can also
+// be written as CSV and / or JSON for tracking regressions between releases.
+
+// options:
+//   -s WxH,WxH,...   image sizes                 (default 320x240,640x480,1280x720)
+//   -t N,N,...       thread counts               (default 1,2,4,.. up to #CPUs)
+//   -n S,S,...       noise sigmas                (default 15,30)
+//   -c N,N,...       channels (1 and / or 3)     (default 3)
+//   -r N             timed runs per measurement  (default 5, + 1 warm up)
+//   -f name,...      filters to run              (default all: gaussian,median,
+//                                                 bilateral,nlm,nlm_aggregate,nlm_opencv)
+//   --csv file       write results as CSV
+//   --json file      write results as JSON
+// (if no image is given a synthetic textured image is used)
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/photo.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <fstream>		// standard C++ file I/O
+#include <sstream>		// standard C++ string streams
+#include <iomanip>		// standard C++ I/O formatting
+#include <string>		// standard C++ I/O
+#include <vector>		// standard C++ containers
+#include <algorithm>    // includes sort()
+#include <cstdlib>      // includes atoi(), atof()
+#include <cstdio>       // includes sscanf()
+#include <cmath>        // includes ceil()
+#include <cstring>      // includes strcmp()
+
+#include "nlm.hpp"              // nonlocalMeansFilter() + engines
+#include "noise.hpp"            // addNoise() - deterministic parallel noise
+#include "image_quality.hpp"    // computeImageQuality() - MSE / PSNR / SSIM
+
+using namespace cv; // OpenCV API is in the C++ "cv" namespace
+using namespace std;
+
+/******************************************************************************/
+
+// the filters under test - p1 / p2 are the window parameters of each filter
+
+enum DenoiserType
+{
+    DENOISE_GAUSSIAN,       // p1 = kernel size (sigma = p1 / 3)
+    DENOISE_MEDIAN,         // p1 = kernel size
+    DENOISE_BILATERAL,      // p1 = diameter (colour sigma = 2 x noise sigma, space sigma = p1 / 2)
+    DENOISE_NLM,            // p1 = template window, p2 = search window (nlm.hpp, h = noise sigma)
+    DENOISE_NLM_AGGREGATE,  // as DENOISE_NLM, patch aggregation (default stride)
+    DENOISE_NLM_OPENCV      // p1 = template window, p2 = search window (OpenCV, h = noise sigma)
+};
+
+struct Denoiser
+{
+    DenoiserType type;
+    string name;
+    int p1, p2;
+};
+
+static const Denoiser denoisers[] = {
+    { DENOISE_GAUSSIAN, "gaussian", 3, 0 },
+    { DENOISE_GAUSSIAN, "gaussian", 7, 0 },
+    { DENOISE_MEDIAN, "median", 3, 0 },
+    { DENOISE_MEDIAN, "median", 5, 0 },
+    { DENOISE_BILATERAL, "bilateral", 5, 0 },
+    { DENOISE_BILATERAL, "bilateral", 9, 0 },
+    { DENOISE_NLM, "nlm", 3, 7 },
+    { DENOISE_NLM, "nlm", 5, 11 },
+    { DENOISE_NLM, "nlm", 7, 21 },
+    { DENOISE_NLM_AGGREGATE, "nlm_aggregate", 3, 7 },
+    { DENOISE_NLM_AGGREGATE, "nlm_aggregate", 5, 11 },
+    { DENOISE_NLM_AGGREGATE, "nlm_aggregate", 7, 21 },
+    { DENOISE_NLM_OPENCV, "nlm_opencv", 3, 7 },
+    { DENOISE_NLM_OPENCV, "nlm_opencv", 5, 11 },
+    { DENOISE_NLM_OPENCV, "nlm_opencv", 7, 21 }
+};
+
+static string denoiserParams(const Denoiser& d)
+{
+    ostringstream s;
+    if ((d.type == DENOISE_NLM) || (d.type == DENOISE_NLM_AGGREGATE) || (d.type == DENOISE_NLM_OPENCV))
+    {
+        s << d.p1 << "/" << d.p2;
+    } else {
+        s << d.p1 << "x" << d.p1;
+    }
+    return s.str();
+}
+
+static void runDenoiser(const Denoiser& d, Mat& src, Mat& dest, double sigma)
+{
+    switch (d.type)
+    {
+    case DENOISE_GAUSSIAN:
+        GaussianBlur(src, dest, Size(d.p1, d.p1), d.p1 / 3.0);
+        break;
+    case DENOISE_MEDIAN:
+        medianBlur(src, dest, d.p1);
+        break;
+    case DENOISE_BILATERAL:
+        bilateralFilter(src, dest, d.p1, 2.0 * sigma, d.p1 / 2.0);
+        break;
+    case DENOISE_NLM:
+        nonlocalMeansFilter(src, dest, d.p1, d.p2, sigma, sigma);
+        break;
+    case DENOISE_NLM_AGGREGATE:
+        nonlocalMeansFilterAggregate(src, dest, d.p1, d.p2, sigma, sigma);
+        break;
+    case DENOISE_NLM_OPENCV:
+        if (src.channels() == 3)
+        {
+            fastNlMeansDenoisingColored(src, dest, (float) sigma, (float) sigma, d.p1, d.p2);
+        } else {
+            fastNlMeansDenoising(src, dest, (float) sigma, d.p1, d.p2);
+        }
+        break;
+    }
+}
+
+/******************************************************************************/
+
+// one row of the results
+
+struct BenchmarkResult
+{
+    string filter, params;
+    int width, height, channels, threads;
+    double sigma;
+    int repeats;
+    double median, p95;     // latency (ms)
+    double mpix;            // throughput (MPix/s) at the median latency
+    ImageQuality quality;
+};
+
+// value at percentile p (nearest rank) of the sorted times
+
+static double percentile(const vector<double>& sorted, double p)
+{
+    size_t rank = (size_t) ceil(p / 100.0 * sorted.size());
+    return sorted[min(sorted.size() - 1, (size_t) max(1, (int) rank) - 1)];
+}
+
+// time one denoiser on one input (+ 1 warm up run)
+
+static BenchmarkResult benchmark(const Denoiser& d, Mat& clean, Mat& noisy, double sigma,
+                                 int threads, int repeats)
+{
+    Mat dest;
+    vector<double> times;
+
+    for (int r = 0; r <= repeats; r++)
+    {
+        int64 pre = getTickCount();
+        runDenoiser(d, noisy, dest, sigma);
+        if (r > 0)
+        {
+            times.push_back(1000.0 * (getTickCount() - pre) / getTickFrequency());
+        }
+    }
+    sort(times.begin(), times.end());
+
+    BenchmarkResult result;
+    result.filter = d.name;
+    result.params = denoiserParams(d);
+    result.width = noisy.cols;
+    result.height = noisy.rows;
+    result.channels = noisy.channels();
+    result.threads = threads;
+    result.sigma = sigma;
+    result.repeats = repeats;
+    result.median = percentile(times, 50);
+    result.p95 = percentile(times, 95);
+    result.mpix = (noisy.cols * (double) noisy.rows) / (1000.0 * result.median);
+    result.quality = computeImageQuality(clean, dest);
+    return result;
+}
+
+/******************************************************************************/
+
+// machine readable output
+
+static void writeCSV(const string& filename, const vector<BenchmarkResult>& results)
+{
+    ofstream out(filename.c_str());
+    out << "filter,params,width,height,channels,threads,sigma,repeats,"
+        << "median_ms,p95_ms,mpix_per_s,psnr_db,ssim" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& r = results[i];
+        out << r.filter << "," << r.params << "," << r.width << "," << r.height << ","
+            << r.channels << "," << r.threads << "," << r.sigma << "," << r.repeats << ","
+            << r.median << "," << r.p95 << "," << r.mpix << ","
+            << r.quality.psnr << "," << r.quality.ssim << endl;
+    }
+}
+
+static void writeJSON(const string& filename, const vector<BenchmarkResult>& results)
+{
+    ofstream out(filename.c_str());
+    out << "{" << endl
+        << "  \"opencv_version\": \"" << CV_VERSION << "\"," << endl
+        << "  \"cpus\": " << getNumberOfCPUs() << "," << endl
+        << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchmarkResult& r = results[i];
+        out << "    { \"filter\": \"" << r.filter << "\", \"params\": \"" << r.params << "\""
+            << ", \"width\": " << r.width << ", \"height\": " << r.height
+            << ", \"channels\": " << r.channels << ", \"threads\": " << r.threads
+            << ", \"sigma\": " << r.sigma << ", \"repeats\": " << r.repeats
+            << ", \"median_ms\": " << r.median << ", \"p95_ms\": " << r.p95
+            << ", \"mpix_per_s\": " << r.mpix
+            << ", \"psnr_db\": " << r.quality.psnr << ", \"ssim\": " << r.quality.ssim << " }"
+            << ((i + 1 < results.size()) ? "," : "") << endl;
+    }
+    out << "  ]" << endl << "}" << endl;
+}
+
+/******************************************************************************/
+
+// split a comma separated option value
+
+static vector<string> splitList(const string& s)
+{
+    vector<string> items;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+/******************************************************************************/
+
+int main( int argc, char** argv )
+{
+    vector<Size> sizes;
+    vector<int> threadCounts;
+    vector<double> sigmas;
+    vector<int> channels;
+    vector<string> filters;
+    int repeats = 5;
+    string csvFile, jsonFile;
+    Mat img;
+
+    // parse options
+
+    for (int i = 1; i < argc; i++)
+    {
+        const bool hasValue = (i + 1 < argc);
+        if (!strcmp(argv[i], "-s") && hasValue)
+        {
+            vector<string> items = splitList(argv[++i]);
+            for (size_t k = 0; k < items.size(); k++)
+            {
+                int w = 0, h = 0;
+                if (sscanf(items[k].c_str(), "%dx%d", &w, &h) == 2) sizes.push_back(Size(w, h));
+            }
+        }
+        else if (!strcmp(argv[i], "-t") && hasValue)
+        {
+            vector<string> items = splitList(argv[++i]);
+            for (size_t k = 0; k < items.size(); k++) threadCounts.push_back(max(1, atoi(items[k].c_str())));
+        }
+        else if (!strcmp(argv[i], "-n") && hasValue)
+        {
+            vector<string> items = splitList(argv[++i]);
+            for (size_t k = 0; k < items.size(); k++) sigmas.push_back(atof(items[k].c_str()));
+        }
+        else if (!strcmp(argv[i], "-c") && hasValue)
+        {
+            vector<string> items = splitList(argv[++i]);
+            for (size_t k = 0; k < items.size(); k++) channels.push_back((atoi(items[k].c_str()) == 1) ? 1 : 3);
+        }
+        else if (!strcmp(argv[i], "-r") && hasValue)
+        {
+            repeats = max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "-f") && hasValue)
+        {
+            filters = splitList(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--csv") && hasValue)
+        {
+            csvFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--json") && hasValue)
+        {
+            jsonFile = argv[++i];
+        }
+        else if (argv[i][0] != '-')
+        {
+            img = imread(argv[i], IMREAD_COLOR);
+            if (img.empty())
+            {
+                std::cerr << "ERROR: cannot read image " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else
+        {
+            std::cerr << "ERROR: unknown option " << argv[i] << " (see source header for usage)" << std::endl;
+            return -1;
+        }
+    }
+
+    // defaults
+
+    if (sizes.empty())
+    {
+        sizes.push_back(Size(320, 240));
+        sizes.push_back(Size(640, 480));
+        sizes.push_back(Size(1280, 720));
+    }
+    if (threadCounts.empty())
+    {
+        for (int t = 1; t < getNumberOfCPUs(); t *= 2) threadCounts.push_back(t);
+        threadCounts.push_back(getNumberOfCPUs());
+    }
+    if (sigmas.empty())
+    {
+        sigmas.push_back(15);
+        sigmas.push_back(30);
+    }
+    if (channels.empty())
+    {
+        channels.push_back(3);
+    }
+    if (img.empty())
+    {
+        // synthetic textured image (at the largest size, resized per size below)
+
+        Size largest(0, 0);
+        for (size_t k = 0; k < sizes.size(); k++)
+        {
+            largest.width = max(largest.width, sizes[k].width);
+            largest.height = max(largest.height, sizes[k].height);
+        }
+        img.create(largest, CV_8UC3);
+        randu(img, Scalar::all(0), Scalar::all(255));
+        GaussianBlur(img, img, Size(0, 0), 3);
+        normalize(img, img, 0, 255, NORM_MINMAX);
+    }
+
+    std::cout << "OpenCV " << CV_VERSION << ", " << getNumberOfCPUs() << " CPUs, "
+              << repeats << " runs per measurement (+1 warm up)" << std::endl << std::endl;
+    std::cout << left << setw(12) << "filter" << setw(8) << "params" << right
+              << setw(11) << "size" << setw(4) << "cn" << setw(8) << "threads" << setw(7) << "sigma"
+              << setw(12) << "median ms" << setw(10) << "p95 ms" << setw(10) << "MPix/s"
+              << setw(9) << "PSNR" << setw(8) << "SSIM" << std::endl;
+
+    // sweep (the noisy input of each size / channels / sigma is shared by all
+    // filters and thread counts - and is reproducible, see noise.hpp)
+
+    vector<BenchmarkResult> results;
+    const int ndenoisers = sizeof(denoisers) / sizeof(denoisers[0]);
+
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        for (size_t c = 0; c < channels.size(); c++)
+        {
+            Mat clean;
+            resize(img, clean, sizes[s], 0, 0, INTER_AREA);
+            if (channels[c] == 1)
+            {
+                cvtColor(clean, clean, COLOR_BGR2GRAY);
+            }
+
+            for (size_t n = 0; n < sigmas.size(); n++)
+            {
+                Mat noisy;
+                addNoise(clean, noisy, sigmas[n]);
+
+                for (int d = 0; d < ndenoisers; d++)
+                {
+                    if (!filters.empty() && (find(filters.begin(), filters.end(), denoisers[d].name) == filters.end()))
+                    {
+                        continue;
+                    }
+                    for (size_t t = 0; t < threadCounts.size(); t++)
+                    {
+                        setNumThreads(threadCounts[t]);     // OpenCV functions
+                    #ifdef _OPENMP
+                        omp_set_num_threads(threadCounts[t]); // nlm.hpp
+                    #endif
+
+                        BenchmarkResult r = benchmark(denoisers[d], clean, noisy, sigmas[n],
+                                                      threadCounts[t], repeats);
+                        results.push_back(r);
+
+                        std::cout << left << setw(12) << r.filter << setw(8) << r.params << right
+                                  << setw(11) << (to_string(r.width) + "x" + to_string(r.height))
+                                  << setw(4) << r.channels << setw(8) << r.threads
+                                  << fixed << setprecision(1) << setw(7) << r.sigma
+                                  << setprecision(2) << setw(12) << r.median << setw(10) << r.p95
+                                  << setw(10) << r.mpix << setw(9) << r.quality.psnr
+                                  << setprecision(4) << setw(8) << r.quality.ssim << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    if (!csvFile.empty())
+    {
+        writeCSV(csvFile, results);
+        std::cout << std::endl << "results written to " << csvFile << std::endl;
+    }
+    if (!jsonFile.empty())
+    {
+        writeJSON(jsonFile, results);
+        std::cout << "results written to " << jsonFile << std::endl;
+    }
+
+    return 0;
+}
+/******************************************************************************/
@@ -1,5 +1,18 @@
 // Example: display magnitude image of DFT of input image
 // usage: prog {<image_name> | <video_name>}
+// (press "r" to toggle registration / stabilisation, "x" to exit)
+
+// The transform runs in a workspace (DFTWorkspace) allocated for the first
+// frame and reused for every following frame of the same size - the number of
+// Mat allocations per frame is counted (CountingMatAllocator) and reported
+// whenever it is not zero, and every 100 frames.
+
+// In registration mode the translation of each frame relative to the previous
+// one is estimated by phase correlation (PhaseCorrelator) from the spectra the
+// workspace already holds - one multiply + one inverse DFT per frame - and
+// printed, and the frames are shown stabilised: shifted to follow a smoothed
+// version of the accumulated camera path (removing shake, keeping slow pans).
+// The frames are windowed (Hanning) before the DFT while registering.
 
 // Author : Toby Breckon, toby.breckon@durham.ac.uk
 
@@ -15,6 +28,8 @@
 #include <string>		// standard C++ I/O
 #include <algorithm>    // includes max()
 
+#include "frequency_filter.hpp" // DFTWorkspace + CountingMatAllocator + PhaseCorrelator
+
 using namespace cv; // OpenCV API is in the C++ "cv" namespace
 using namespace std;
 /******************************************************************************/
@@ -29,69 +44,9 @@ using namespace std;
 	#define CAMERA_INDEX -1
 #endif
 /******************************************************************************/
-// Rearrange the quadrants of a Fourier image so that the origin is at
-// the image center
-
-void shiftDFT(Mat& fImage )
-{
-  	Mat tmp, q0, q1, q2, q3;
-
-	// first crop the image, if it has an odd number of rows or columns
-
-	fImage = fImage(Rect(0, 0, fImage.cols & -2, fImage.rows & -2));
-
-	int cx = fImage.cols/2;
-	int cy = fImage.rows/2;
-
-	// rearrange the quadrants of Fourier image
-	// so that the origin is at the image center
 
-	q0 = fImage(Rect(0, 0, cx, cy));
-	q1 = fImage(Rect(cx, 0, cx, cy));
-	q2 = fImage(Rect(0, cy, cx, cy));
-	q3 = fImage(Rect(cx, cy, cx, cy));
-
-	q0.copyTo(tmp);
-	q3.copyTo(q0);
-	tmp.copyTo(q3);
-
-	q1.copyTo(tmp);
-	q2.copyTo(q1);
-	tmp.copyTo(q2);
-}
-
-/******************************************************************************/
-// return a floating point spectrum magnitude image scaled for user viewing
-// complexImg- input dft (2 channel floating point, Real + Imaginary fourier image)
-// rearrange - perform rearrangement of DFT quadrants if true
-
-// return value - pointer to output spectrum magnitude image scaled for user viewing
-
-Mat create_spectrum_magnitude_display(Mat& complexImg, bool rearrange)
-{
-    Mat planes[2];
-
-    // compute magnitude spectrum (N.B. for display)
-    // compute log(1 + sqrt(Re(DFT(img))**2 + Im(DFT(img))**2))
-
-    split(complexImg, planes);
-    magnitude(planes[0], planes[1], planes[0]);
-
-    Mat mag = (planes[0]).clone();
-    mag += Scalar::all(1);
-    log(mag, mag);
-
-    if (rearrange)
-    {
-        // re-arrange the quaderants
-        shiftDFT(mag);
-    }
-
-    normalize(mag, mag, 0, 1, NORM_MINMAX);
-
-    return mag;
-
-}
+#define STABILISE_SMOOTHING 0.9         // weight of the past in the smoothed camera path
+#define REGISTRATION_MIN_RESPONSE 0.05  // peak below which a shift estimate is ignored
 
 /******************************************************************************/
 
@@ -101,14 +56,28 @@ int main( int argc, char** argv )
   Mat img, imgGray;	// image object
   VideoCapture cap; // capture object
 
-  Mat padded;		// fourier image objects and arrays
-  Mat complexImg;
-  Mat planes[2], mag;
+  DFTWorkspace dftWorkspace;	// fourier image objects and arrays (sized once)
+  Mat mag;
 
-  int N, M; // fourier image sizes
+  // count every Mat allocation (static - must outlive all Mats allocated
+  // through it)
+
+  static CountingMatAllocator allocationCounter;
+  Mat::setDefaultAllocator(&allocationCounter);
+  int64 frames = 0;
+
+  // registration / stabilisation
+
+  bool registering = false;     // toggled with "r"
+  PhaseCorrelator registration;
+  Point2d path(0, 0);           // accumulated frame to frame shifts
+  Point2d smoothPath(0, 0);     // smoothed (intended) camera path
+  Mat correction(2, 3, CV_64F); // stabilising translation
+  Mat stabilised;
 
   const string originalName = "Input Image (grayscale)"; // window name
   const string spectrumMagName = "Magnitude Image (log transformed)"; // window name
+  const string stabilisedName = "Stabilised (phase correlation)"; // window name
 
   bool keepProcessing = true;	// loop control flag
   unsigned char key;						// user input
@@ -161,29 +130,56 @@ int main( int argc, char** argv )
 
 		  // ***
 
+		    int64 allocations = allocationCounter.allocations();
+
 		    // convert input to grayscale
 
 		  	cvtColor(img, imgGray, COLOR_BGR2GRAY);
 
-			// setup the DFT images
+			// do the DFT (real input - packed CCS spectrum) - padded into the
+			// workspace buffers, only (re)sized if the frame size changes
 
-			M = getOptimalDFTSize( imgGray.rows );
-	  		N = getOptimalDFTSize( imgGray.cols );
+		    dftWorkspace.transform(imgGray);
 
-	  		copyMakeBorder(imgGray, padded, 0, M - imgGray.rows, 0,
-			      N - imgGray.cols, BORDER_CONSTANT, Scalar::all(0));
-	  		planes[0] = Mat_<float>(padded);
-		    planes[1] = Mat::zeros(padded.size(), CV_32F);
+			// create magnitude for output (in the workspace)
 
-	  		merge(planes, 2, complexImg);
+		    mag = dftWorkspace.magnitudeDisplay(true);
 
-			// do the DFT
+		    // estimate the shift from the previous frame (cached spectra) and
+		    // shift the frame onto the smoothed camera path
 
-		    dft(complexImg, complexImg);
+		    if (registering && dftWorkspace.hasPrevious())
+		    {
+		        double response;
+		        Point2d shift = registration.estimate(dftWorkspace.previous(), dftWorkspace.spectrum(), &response);
+		        if (response < REGISTRATION_MIN_RESPONSE)
+		        {
+		            shift = Point2d(0, 0);
+		        }
 
-			// create magnitude for output
+		        path += shift;
+		        smoothPath = STABILISE_SMOOTHING * smoothPath + (1.0 - STABILISE_SMOOTHING) * path;
 
-		    mag = create_spectrum_magnitude_display(complexImg, true);
+		        std::cout << "shift: (" << shift.x << ", " << shift.y << ") response " << response
+		                  << " path: (" << path.x << ", " << path.y << ")" << std::endl;
+
+		        correction.at<double>(0, 0) = 1;
+		        correction.at<double>(0, 1) = 0;
+		        correction.at<double>(0, 2) = smoothPath.x - path.x;
+		        correction.at<double>(1, 0) = 0;
+		        correction.at<double>(1, 1) = 1;
+		        correction.at<double>(1, 2) = smoothPath.y - path.y;
+		        warpAffine(img, stabilised, correction, img.size());
+		    }
+
+		    allocations = allocationCounter.allocations() - allocations;
+		    frames++;
+		    if ((allocations != 0) || ((frames % 100) == 0))
+		    {
+		        std::cout << "frame " << frames << ": " << allocations << " Mat allocations ("
+		                  << dftWorkspace.dftSize().width << " x " << dftWorkspace.dftSize().height
+		                  << " DFT)" << std::endl;
+		    }
 
 		  // ***
 
@@ -191,6 +187,10 @@ int main( int argc, char** argv )
 
 		  imshow(originalName, imgGray);
 		  imshow(spectrumMagName, mag);
+		  if (registering && !stabilised.empty())
+		  {
+		      imshow(stabilisedName, stabilised);
+		  }
 
 		  // start event processing loop (very important,in fact essential for GUI)
 	      // 40 ms roughly equates to 1000ms/25fps = 4ms per frame
@@ -210,6 +210,22 @@ int main( int argc, char** argv )
 				  		  << std::endl;
 	   			keepProcessing = false;
 		  }
+		  else if (key == 'r'){
+
+			// if user presses "r" then toggle registration / stabilisation
+			// (starting again from a still camera path)
+
+			  	registering = !registering;
+			  	dftWorkspace.setWindow(registering);
+			  	path = smoothPath = Point2d(0, 0);
+			  	stabilised.release();
+			  	if (registering)
+			  	{
+			  	    namedWindow(stabilisedName, 0);
+			  	} else {
+			  	    destroyWindow(stabilisedName);
+			  	}
+		  }
 	  }
 
 	  // the camera will be deinitialized automatically in VideoCapture destructor
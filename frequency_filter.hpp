@@ -0,0 +1,1556 @@
+// Frequency domain filters + DFT display - shared implementation for
+// fourier.cpp / butterworth_lowpass.cpp (and other DFT based examples)
+
+// Real (grayscale) images are transformed with a real input dft(), giving the
+// packed CCS spectrum (1 channel, same size as the image - the conjugate
+// symmetric half of the spectrum only), which mulSpectrums() and
+// idft(.., DFT_REAL_OUTPUT) work on directly - half the memory and roughly half
+// the FFT work of a full complex dft() with a zero imaginary plane. See the
+// OpenCV dft() documentation for the CCS layout.
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2011 School of Engineering, Cranfield University
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#ifndef FREQUENCY_FILTER_HPP
+#define FREQUENCY_FILTER_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <vector>		// standard C++ containers
+#include <algorithm>    // includes swap_ranges()
+#include <cmath>        // includes pow(), sqrt(), log(), exp()
+#include <cfloat>       // includes FLT_MIN, FLT_MAX, DBL_MAX
+#include <atomic>       // includes std::atomic (allocation counter)
+
+/******************************************************************************/
+// Rearrange the quadrants of a Fourier image so that the origin is at
+// the image center
+
+// (the quadrants are swapped in place, row by row - no temporary copies; only
+// needed for display, as filters can be created directly in the unshifted
+// layout of the dft() output - see create_complex_filter() / create_ccs_filter())
+
+inline void shiftDFT(cv::Mat& fImage )
+{
+    // first crop the image, if it has an odd number of rows or columns
+
+    fImage = fImage(cv::Rect(0, 0, fImage.cols & -2, fImage.rows & -2));
+
+    int cx = fImage.cols/2;
+    int cy = fImage.rows/2;
+    const size_t half = cx * fImage.elemSize();
+
+    // rearrange the quadrants of Fourier image
+    // so that the origin is at the image center
+    // (q0 <-> q3 and q1 <-> q2, i.e. top left <-> bottom right, top right <-> bottom left)
+
+    for (int y = 0; y < cy; y++)
+    {
+        uchar* top = fImage.ptr(y);
+        uchar* bottom = fImage.ptr(y + cy);
+        std::swap_ranges(top, top + half, bottom + half);
+        std::swap_ranges(top + half, top + 2 * half, bottom);
+    }
+}
+
+/******************************************************************************/
+// magnitude of every frequency (M x N, origin at the top left as for a full
+// complex dft()) from a packed CCS spectrum (M x N, 1 channel floating point) -
+// each packed (Re, Im) pair gives the magnitude of its frequency (u,v) and, by
+// conjugate symmetry, of (-u,-v)
+
+inline void ccs_magnitude(const cv::Mat& ccs, cv::Mat& mag)
+{
+    const int M = ccs.rows;
+    const int N = ccs.cols;
+    const bool evenN = ((N % 2) == 0);
+    const int K = evenN ? (N / 2 - 1) : ((N - 1) / 2);    // pairs per row (v = 1 .. K)
+
+    mag.create(M, N, CV_32F);
+
+    // v = 1 .. K - packed as (Re, Im) pairs along each row u
+
+    for (int r = 0; r < M; r++)
+    {
+        const float* f = ccs.ptr<float>(r);
+        float* m = mag.ptr<float>(r);
+        float* mc = mag.ptr<float>((M - r) % M);
+        for (int k = 1; k <= K; k++)
+        {
+            const float a = std::sqrt(f[2*k-1] * f[2*k-1] + f[2*k] * f[2*k]);
+            m[k] = a;
+            mc[N - k] = a;
+        }
+    }
+
+    // v = 0 (column 0) and v = N/2 (last column, N even only) - packed as
+    // (Re, Im) pairs down the column (Re only for u = 0 and u = M/2)
+
+    for (int i = 0; i < (evenN ? 2 : 1); i++)
+    {
+        const int col = (i == 0) ? 0 : (N - 1);
+        const int v = (i == 0) ? 0 : N / 2;
+        mag.at<float>(0, v) = std::abs(ccs.at<float>(0, col));
+        for (int t = 1; 2*t - 1 < M; t++)
+        {
+            const float re = ccs.at<float>(2*t - 1, col);
+            const float im = (2*t < M) ? ccs.at<float>(2*t, col) : 0.0f;
+            const float a = std::sqrt(re * re + im * im);
+            mag.at<float>(t, v) = a;
+            mag.at<float>(M - t, v) = a;
+        }
+    }
+}
+
+/******************************************************************************/
+// fused log magnitude display kernel - the display image log(1 + |F(u,v)|),
+// rearranged (as shiftDFT()) and normalised to [0,1] (as normalize(..,
+// NORM_MINMAX)), computed from the spectrum in two passes with no temporary
+// images: the first finds the range of the power |F|^2 over the frequencies
+// displayed (log(1 + sqrt(.)) being monotonic, that gives the range of the
+// display), the second computes each display value and writes it straight to
+// its rearranged position. Both passes work row by row, the frequencies of a
+// display row gathered into a small per thread buffer (for a packed CCS
+// spectrum from the pair of rows u and -u holding them), the rows in parallel
+// (OpenMP), with AVX2 kernels for the power, range and log (selected at
+// runtime; cv::setUseOptimized(false) forces the scalar reference kernels).
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+    #define FREQUENCY_HAVE_AVX2 1
+    #include <immintrin.h>
+#else
+    #define FREQUENCY_HAVE_AVX2 0
+#endif
+
+// row kernels - power p[i] = re^2 + im^2 of n interleaved (re, im) pairs, range
+// [lo, hi] of n values, display value (log(1 + sqrt(p[i])) - offset) * scale
+
+typedef void (*SpectrumPowerFn)(const float* f, float* p, int n);
+typedef void (*SpectrumRangeFn)(const float* p, int n, float& lo, float& hi);
+typedef void (*SpectrumLogFn)(const float* p, float* out, int n, float offset, float scale);
+
+inline void spectrumPowerScalar(const float* f, float* p, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        p[i] = f[2*i] * f[2*i] + f[2*i+1] * f[2*i+1];
+    }
+}
+
+inline void spectrumRangeScalar(const float* p, int n, float& lo, float& hi)
+{
+    for (int i = 0; i < n; i++)
+    {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+    }
+}
+
+inline void spectrumLogScalar(const float* p, float* out, int n, float offset, float scale)
+{
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = (std::log(1.0f + std::sqrt(p[i])) - offset) * scale;
+    }
+}
+
+#if FREQUENCY_HAVE_AVX2
+
+// AVX2: 8 values per step - natural log of 8 positive floats (cephes logf:
+// x = m 2^e with m in [sqrt(0.5), sqrt(2)), log(m) by a degree 9 polynomial in
+// m - 1; within a few float ulp of std::log())
+
+__attribute__((target("avx2")))
+inline __m256 spectrumLogAVX2(__m256 x)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i bits = _mm256_castps_si256(x);
+
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                                                   _mm256_set1_epi32(0x3f000000)));   // [0.5, 1)
+    const __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+    m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(m, small));               // m - 1 (or 2m - 1)
+
+    const __m256 z = _mm256_mul_ps(m, m);
+    __m256 y = _mm256_set1_ps(7.0376836292E-2f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.1514610310E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.1676998740E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.2420140846E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(1.4249322787E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-1.6668057665E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(2.0000714765E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(-2.4999993993E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(3.3333331174E-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+
+    y = _mm256_add_ps(y, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+    y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+    return _mm256_add_ps(_mm256_add_ps(m, y), _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+}
+
+__attribute__((target("avx2")))
+inline void spectrumPowerAVX2(const float* f, float* p, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 a = _mm256_loadu_ps(f + 2*i);
+        const __m256 b = _mm256_loadu_ps(f + 2*i + 8);
+
+        // pair sums come out as p0 p1 p4 p5 | p2 p3 p6 p7 - put back in order
+
+        const __m256 s = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+        _mm256_storeu_ps(p + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(s), 0xD8)));
+    }
+    spectrumPowerScalar(f + 2*i, p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void spectrumRangeAVX2(const float* p, int n, float& lo, float& hi)
+{
+    int i = 0;
+    if (n >= 8)
+    {
+        __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+        for (; i + 8 <= n; i += 8)
+        {
+            const __m256 v = _mm256_loadu_ps(p + i);
+            vlo = _mm256_min_ps(vlo, v);
+            vhi = _mm256_max_ps(vhi, v);
+        }
+        float l[8], h[8];
+        _mm256_storeu_ps(l, vlo);
+        _mm256_storeu_ps(h, vhi);
+        spectrumRangeScalar(l, 8, lo, hi);
+        spectrumRangeScalar(h, 8, lo, hi);
+    }
+    spectrumRangeScalar(p + i, n - i, lo, hi);
+}
+
+__attribute__((target("avx2")))
+inline void spectrumLogAVX2(const float* p, float* out, int n, float offset, float scale)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 voffset = _mm256_set1_ps(offset);
+    const __m256 vscale = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 v = spectrumLogAVX2(_mm256_add_ps(one, _mm256_sqrt_ps(_mm256_loadu_ps(p + i))));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_sub_ps(v, voffset), vscale));
+    }
+    spectrumLogScalar(p + i, out + i, n - i, offset, scale);
+}
+
+#endif
+
+// select the kernels for this CPU at runtime
+
+inline void getSpectrumKernels(SpectrumPowerFn& power, SpectrumRangeFn& range, SpectrumLogFn& logMag)
+{
+    power = spectrumPowerScalar;
+    range = spectrumRangeScalar;
+    logMag = spectrumLogScalar;
+#if FREQUENCY_HAVE_AVX2
+    if (cv::useOptimized() && cv::checkHardwareSupport(CV_CPU_AVX2))
+    {
+        power = spectrumPowerAVX2;
+        range = spectrumRangeAVX2;
+        logMag = spectrumLogAVX2;
+    }
+#endif
+}
+
+// power of every frequency of spectrum row u (origin at the top left, as
+// ccs_magnitude()) into row[0..N) - pairs[] is scratch for N / 2 + 1 values
+
+inline void spectrumPowerRow(const cv::Mat& spectrum, int u, float* row, float* pairs, SpectrumPowerFn power)
+{
+    const int M = spectrum.rows;
+    const int N = spectrum.cols;
+
+    if (spectrum.channels() == 2)
+    {
+        power(spectrum.ptr<float>(u), row, N);
+        return;
+    }
+
+    // packed CCS - (u, v) for v = 1 .. K from row u, (u, -v) = conj(-u, v)
+    // from row -u (reversed), v = 0 and v = N/2 from the packed columns
+
+    const bool evenN = ((N % 2) == 0);
+    const int K = evenN ? (N / 2 - 1) : ((N - 1) / 2);
+    const int t = std::min(u, M - u);   // |u|
+
+    power(spectrum.ptr<float>(u) + 1, row + 1, K);
+    power(spectrum.ptr<float>((M - u) % M) + 1, pairs, K);
+    for (int k = 1; k <= K; k++)
+    {
+        row[N - k] = pairs[k - 1];
+    }
+
+    for (int i = 0; i < (evenN ? 2 : 1); i++)
+    {
+        const int col = (i == 0) ? 0 : (N - 1);
+        float re, im = 0.0f;
+        if (t == 0)
+        {
+            re = spectrum.at<float>(0, col);
+        } else {
+            re = spectrum.at<float>(2*t - 1, col);
+            if (2*t < M) im = spectrum.at<float>(2*t, col);
+        }
+        row[(i == 0) ? 0 : (N / 2)] = re * re + im * im;
+    }
+}
+
+// display image (CV_32F, [0,1]) of spectrum (1 channel packed CCS or 2 channel
+// complex, CV_32F) - rearranged if rearrange (cropped to even size, as
+// shiftDFT()); display is only reallocated if its size changes. scratch is
+// caller owned working storage (one row per chunk of spectrum rows: the row
+// power, the CCS pairs and the chunk's power range), likewise only reallocated
+// if the spectrum width changes, so repeated calls perform no allocation.
+
+inline void spectrum_log_magnitude(const cv::Mat& spectrum, cv::Mat& display, cv::Mat& scratch,
+                                   bool rearrange=true)
+{
+    if (spectrum.depth() != CV_32F)
+    {
+        cv::Mat spectrumFloat;
+        spectrum.convertTo(spectrumFloat, CV_32F);
+        spectrum_log_magnitude(spectrumFloat, display, scratch, rearrange);
+        return;
+    }
+
+    const int M = spectrum.rows;
+    const int N = spectrum.cols;
+    const int rows = rearrange ? (M & -2) : M;
+    const int cols = rearrange ? (N & -2) : N;
+    const int sy = rearrange ? (rows / 2) : 0;      // shift of the origin
+    const int sx = rearrange ? (cols / 2) : 0;
+
+    SpectrumPowerFn power;
+    SpectrumRangeFn range;
+    SpectrumLogFn logMag;
+    getSpectrumKernels(power, range, logMag);
+
+    display.create(rows, cols, CV_32F);
+
+    // rows are processed in chunks (a few per CPU, in parallel with OpenMP),
+    // each chunk using its own scratch row [power (N) | pairs (N / 2 + 1) | lo, hi]
+
+    const int maxChunks = 4 * cv::getNumberOfCPUs();
+    const int chunks = std::max(1, std::min(rows, maxChunks));
+    const int pairsAt = N;
+    const int rangeAt = N + N / 2 + 1;
+    scratch.create(maxChunks, rangeAt + 2, CV_32F);
+
+    // pass 1 - range of the power over the frequencies displayed
+
+#pragma omp parallel for schedule(static)
+    for (int c = 0; c < chunks; c++)
+    {
+        float* row = scratch.ptr<float>(c);
+        float tlo = FLT_MAX, thi = 0.0f;
+        for (int u = (int) ((int64) rows * c / chunks); u < (int) ((int64) rows * (c + 1) / chunks); u++)
+        {
+            spectrumPowerRow(spectrum, u, row, row + pairsAt, power);
+            range(row, cols, tlo, thi);
+        }
+        row[rangeAt] = tlo;
+        row[rangeAt + 1] = thi;
+    }
+
+    float lo = FLT_MAX, hi = 0.0f;
+    for (int c = 0; c < chunks; c++)
+    {
+        lo = std::min(lo, scratch.at<float>(c, rangeAt));
+        hi = std::max(hi, scratch.at<float>(c, rangeAt + 1));
+    }
+
+    // pass 2 - display values, written to their rearranged positions
+
+    const float offset = std::log(1.0f + std::sqrt(lo));
+    const float top = std::log(1.0f + std::sqrt(hi));
+    const float scale = (top > offset) ? (1.0f / (top - offset)) : 0.0f;
+
+#pragma omp parallel for schedule(static)
+    for (int c = 0; c < chunks; c++)
+    {
+        float* row = scratch.ptr<float>(c);
+        for (int u = (int) ((int64) rows * c / chunks); u < (int) ((int64) rows * (c + 1) / chunks); u++)
+        {
+            spectrumPowerRow(spectrum, u, row, row + pairsAt, power);
+            float* out = display.ptr<float>((u + sy) % rows);
+            logMag(row, out + sx, cols - sx, offset, scale);
+            logMag(row + cols - sx, out, sx, offset, scale);
+        }
+    }
+}
+
+// (as above, with temporary scratch storage)
+
+inline void spectrum_log_magnitude(const cv::Mat& spectrum, cv::Mat& display, bool rearrange=true)
+{
+    cv::Mat scratch;
+    spectrum_log_magnitude(spectrum, display, scratch, rearrange);
+}
+
+/******************************************************************************/
+// return a floating point spectrum magnitude image scaled for user viewing
+// complexImg- input dft (2 channel floating point, Real + Imaginary fourier image,
+//             or 1 channel packed CCS spectrum of a real input dft())
+// rearrange - perform rearrangement of DFT quadrants if true
+
+// return value - pointer to output spectrum magnitude image scaled for user viewing
+
+// (log(1 + magnitude), rearrangement + normalisation all fused into
+// spectrum_log_magnitude() above - two passes over the spectrum, no temporaries)
+
+inline cv::Mat create_spectrum_magnitude_display(cv::Mat& complexImg, bool rearrange)
+{
+    cv::Mat mag;
+    spectrum_log_magnitude(complexImg, mag, rearrange);
+    return mag;
+}
+
+/******************************************************************************/
+// DFT workspace - the buffers of the per frame transform of an image (zero
+// padded image, its float copy, the packed spectrum and the display image),
+// sized once and reused for every frame of the same size and type, so that
+// once the first frame of a fixed resolution stream is done the transform and
+// display perform no (Mat) allocation. The DFT size is only recomputed when
+// the image size changes. The spectrum of the previous frame is kept too (the
+// two spectrum buffers swap roles each frame), e.g. for phase correlation
+// against the current one (see PhaseCorrelator below), and the frame can be
+// multiplied by a Hanning window before the transform (setWindow()), which
+// stops the image borders dominating such a comparison.
+
+class DFTWorkspace
+{
+public:
+    DFTWorkspace() : imageSize(0, 0), imageType(-1), M(0), N(0), transforms(0), windowed(false) {}
+
+    // size the buffers for images of this size and type (1 channel) - returns
+    // true if they were (re)sized, false if already so
+
+    bool prepare(cv::Size size, int type)
+    {
+        if ((size == imageSize) && (type == imageType)) return false;
+        imageSize = size;
+        imageType = type;
+        M = cv::getOptimalDFTSize(size.height);
+        N = cv::getOptimalDFTSize(size.width);
+        padded.create(M, N, type);
+        realImg.create(M, N, CV_32F);
+        complexImg.create(M, N, CV_32F);
+        previousImg.create(M, N, CV_32F);
+        cv::createHanningWindow(window, size, CV_32F);
+        transforms = 0;
+        return true;
+    }
+
+    // (un)set the Hanning window - spectra from before the change are not
+    // comparable with those after, so the previous spectrum is dropped
+
+    void setWindow(bool on)
+    {
+        if (on != windowed) transforms = 0;
+        windowed = on;
+    }
+
+    // DFT (real input - packed CCS spectrum) of img, zero padded into the
+    // workspace by copyMakeBorder()
+
+    const cv::Mat& transform(const cv::Mat& img)
+    {
+        prepare(img.size(), img.type());
+        cv::copyMakeBorder(img, padded, 0, M - img.rows, 0, N - img.cols,
+                           cv::BORDER_CONSTANT, cv::Scalar::all(0));
+        padded.convertTo(realImg, CV_32F);
+        if (windowed)
+        {
+            cv::Mat inside = realImg(cv::Rect(0, 0, img.cols, img.rows));
+            cv::multiply(inside, window, inside);
+        }
+        std::swap(complexImg, previousImg);
+        cv::dft(realImg, complexImg);
+        transforms++;
+        return complexImg;
+    }
+
+    // spectrum magnitude of the last transform() scaled for display (as
+    // create_spectrum_magnitude_display()) - valid until the next call
+
+    const cv::Mat& magnitudeDisplay(bool rearrange=true)
+    {
+        spectrum_log_magnitude(complexImg, display, scratch, rearrange);
+        return display;
+    }
+
+    const cv::Mat& spectrum() const { return complexImg; }
+    cv::Size dftSize() const { return cv::Size(N, M); }
+
+    // spectrum of the frame before the last transform() (same size and
+    // window) - only if hasPrevious()
+
+    const cv::Mat& previous() const { return previousImg; }
+    bool hasPrevious() const { return transforms >= 2; }
+
+private:
+    cv::Size imageSize;
+    int imageType;
+    int M, N;               // DFT size
+    int transforms;         // transforms since the last (re)size / window change
+    bool windowed;
+    cv::Mat padded, realImg, complexImg, previousImg, window, display;
+    cv::Mat scratch;        // spectrum_log_magnitude() working rows
+};
+
+// Mat allocator counting the buffers allocated through it (passing them on to
+// the standard allocator) - installed with cv::Mat::setDefaultAllocator() it
+// counts every Mat allocation made, e.g. to check a loop reaches a steady state
+// with none. Only Mat buffers are seen - other heap allocations (std::vector,
+// OpenCV internals not using a Mat) are not counted. It must outlive every Mat
+// allocated while installed.
+
+#if CV_MAJOR_VERSION >= 4
+typedef cv::AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+class CountingMatAllocator : public cv::MatAllocator
+{
+public:
+    CountingMatAllocator() : base(cv::Mat::getStdAllocator()), count(0) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           MatAccessFlag flags, cv::UMatUsageFlags usageFlags) const
+    {
+        if (data == NULL)   // (not when wrapping user data)
+        {
+            count++;
+        }
+        return base->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+
+    bool allocate(cv::UMatData* data, MatAccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const
+    {
+        return base->allocate(data, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* data) const
+    {
+        base->deallocate(data);
+    }
+
+    int64 allocations() const { return count.load(); }
+
+private:
+    const cv::MatAllocator* base;
+    mutable std::atomic<int64> count;   // (Mats may be allocated from any thread)
+};
+
+/******************************************************************************/
+// phase correlation - the translation between two frames from their spectra
+// (packed CCS, same size): the cross-power spectrum F2 F1* / |F2 F1*| has
+// unit magnitude and the phase of the shift, so its inverse DFT is (ideally) a
+// single peak at the shift of frame 2 relative to frame 1. With the spectra
+// already computed (e.g. kept by DFTWorkspace) an estimate costs one
+// mulSpectrums(), one inverse DFT and a peak search. The peak is refined to
+// sub-pixel accuracy per axis from its larger neighbour (Foroosh et al.,
+// "Extension of phase correlation to subpixel registration", IEEE Trans. Image
+// Processing, 2002) - for windowed frames typically within 0.1 pixel.
+
+// normalise every frequency of a spectrum (packed CCS or 2 channel complex) to
+// unit magnitude, i.e. keep only its phase (zero where the magnitude is zero)
+
+inline void normalizePhase(float& re, float& im)
+{
+    const float m = std::sqrt(re * re + im * im);
+    if (m > FLT_MIN)
+    {
+        re /= m;
+        im /= m;
+    } else {
+        re = im = 0.0f;
+    }
+}
+
+inline void spectrum_normalize_phase(cv::Mat& spectrum)
+{
+    const int M = spectrum.rows;
+    const int N = spectrum.cols;
+
+    if (spectrum.channels() == 2)
+    {
+        for (int r = 0; r < M; r++)
+        {
+            float* f = spectrum.ptr<float>(r);
+            for (int c = 0; c < N; c++)
+            {
+                normalizePhase(f[2*c], f[2*c + 1]);
+            }
+        }
+        return;
+    }
+
+    const bool evenN = ((N % 2) == 0);
+    const int pairEnd = evenN ? (N - 1) : N;    // columns [1, pairEnd) hold (Re, Im) pairs
+
+    for (int r = 0; r < M; r++)
+    {
+        float* f = spectrum.ptr<float>(r);
+        for (int c = 1; c < pairEnd; c += 2)
+        {
+            normalizePhase(f[c], f[c + 1]);
+        }
+    }
+
+    // v = 0 and v = N/2 columns - pairs down the column, real only for u = 0
+    // (and u = M/2)
+
+    for (int i = 0; i < (evenN ? 2 : 1); i++)
+    {
+        const int col = (i == 0) ? 0 : (N - 1);
+        float zero = 0.0f;
+        normalizePhase(spectrum.at<float>(0, col), zero);
+        for (int t = 1; 2*t - 1 < M; t++)
+        {
+            if (2*t < M)
+            {
+                normalizePhase(spectrum.at<float>(2*t - 1, col), spectrum.at<float>(2*t, col));
+            } else {
+                normalizePhase(spectrum.at<float>(2*t - 1, col), zero);
+            }
+        }
+    }
+}
+
+class PhaseCorrelator
+{
+public:
+
+    // shift (x, y) of the frame with spectrum current relative to the one with
+    // spectrum previous; response (if given) is the peak height in [0,1] - near
+    // 1 for a clean translation, low if the frames do not match
+
+    cv::Point2d estimate(const cv::Mat& previous, const cv::Mat& current, double* response=NULL)
+    {
+        cv::mulSpectrums(current, previous, crossPower, 0, true);
+        spectrum_normalize_phase(crossPower);
+        cv::idft(crossPower, surface, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+        double peakValue;
+        cv::Point peak;
+        cv::minMaxLoc(surface, NULL, &peakValue, NULL, &peak);
+        if (response != NULL)
+        {
+            *response = peakValue;
+        }
+
+        const int M = surface.rows;
+        const int N = surface.cols;
+        const float c = (float) peakValue;
+        const float* row = surface.ptr<float>(peak.y);
+        double x = peak.x + subPixel(row[(peak.x + N - 1) % N], c, row[(peak.x + 1) % N]);
+        double y = peak.y + subPixel(surface.at<float>((peak.y + M - 1) % M, peak.x), c,
+                                     surface.at<float>((peak.y + 1) % M, peak.x));
+
+        // (the surface wraps around - shifts past half way are negative)
+
+        if (x > N / 2) x -= N;
+        if (y > M / 2) y -= M;
+        return cv::Point2d(x, y);
+    }
+
+private:
+
+    // sub-pixel offset of a peak c from its neighbours l, r
+
+    static double subPixel(float l, float c, float r)
+    {
+        if ((r > l) && (r + c > 0)) return r / (r + c);
+        if ((l > r) && (l + c > 0)) return -l / (l + c);
+        return 0.0;
+    }
+
+    cv::Mat crossPower, surface;    // (reused for every estimate)
+};
+
+/******************************************************************************/
+
+// create a 2-channel butterworth low-pass filter with radius D, order n
+// (assumes pre-aollocated size of dft_Filter specifies dimensions)
+// - centred, i.e. for a spectrum rearranged with shiftDFT() (see
+// create_butterworth_lowpass_filter_unshifted() below to avoid that)
+
+// void create_butterworth_lowpass_filter(Mat &dft_Filter, int D, int n)
+// {
+// 	Mat tmp = Mat(dft_Filter.rows, dft_Filter.cols, CV_32F);
+//
+// 	Point centre = Point(dft_Filter.rows / 2, dft_Filter.cols / 2);
+// 	double radius;
+//
+// 	// based on the forumla in the IP notes (p. 130 of 2009/10 version)
+// 	// see also HIPR2 on-line
+//
+// 	for(int i = 0; i < dft_Filter.rows; i++)
+// 	{
+// 		for(int j = 0; j < dft_Filter.cols; j++)
+// 		{
+// 			radius = (double) sqrt(pow((i - centre.x), 2.0) + pow((double) (j - centre.y), 2.0));
+// 			tmp.at<float>(i,j) = (float)
+// 						( 1 / (1 + pow((double) (radius /  D), (double) (2 * n))));
+// 		}
+// 	}
+//
+//     Mat toMerge[] = {tmp, tmp};
+// 	merge(toMerge, 2, dft_Filter);
+// }
+
+// improved version thanks to: James Freeman, GP2U
+
+// fix 1: rows (y) and the cols (x) transposed which then leads on to  confusing
+// comparison of i (y axis) to centre.x and j (x axis) to centre.y
+// fix 2: doesn't work if dftFilter is even size (in above version)
+// fix 3: Creating one quadrant correctly and then flipping it into the other
+// 3 quadrants also saves 75% of the pow/sqrt calls and speeds it up by ~70%
+
+inline void create_butterworth_lowpass_filter(cv::Mat& dftFilter, int radius, int order)
+{
+    cv::Mat tmp = cv::Mat(dftFilter.rows, dftFilter.cols, CV_32F);
+
+    int cy = dftFilter.rows / 2;
+    int cx = dftFilter.cols / 2;
+    cv::Mat q0 = tmp(cv::Rect(0, 0, cx, cy));
+    cv::Mat q1 = tmp(cv::Rect(cx, 0, cx, cy));
+    cv::Mat q2 = tmp(cv::Rect(0, cy, cx, cy));
+    cv::Mat q3 = tmp(cv::Rect(cx, cy, cx, cy));
+
+    // _create one quadrant...
+    for (int yi = 0; yi < cy; yi++)
+        for (int xi = 0; xi < cx; xi++)
+            q3.at<float>(yi, xi) = (1.0 / (1 + std::pow((cv::sqrt(yi * yi + xi * xi) / radius), order)));
+
+    // now flip into place to _create the rest of filter
+
+    cv::flip(q3, q1, 0);
+    cv::flip(q3, q2, 1);
+    cv::flip(q3, q0, -1);
+
+    // to multiply a DFT image by a filter, this filter
+    // should be real only, otherwise the multiplication
+    // changes the phase along with the magnitude of each
+    // pixel in the DFT - bug fix, 01/2023 - https://github.com/epitalon
+
+    cv::Mat toMerge[] = { tmp, cv::Mat::zeros(tmp.size(), CV_32F) };
+    cv::merge(toMerge, 2, dftFilter);
+}
+
+/******************************************************************************/
+// filters in unshifted layout - create_complex_filter() fills an M x N 2-channel
+// filter with the gain H(u, v) of each frequency (u, v signed, origin at the top
+// left as in the dft() output) in the real plane and zero in the imaginary one,
+// so it can be applied with mulSpectrums() directly to a full complex dft()
+// (no shiftDFT() before / after, as a centred filter needs).
+
+template<typename TransferFunction>
+inline void create_complex_filter(cv::Mat& dftFilter, const TransferFunction& H)
+{
+    const int M = dftFilter.rows;
+    const int N = dftFilter.cols;
+
+    for (int r = 0; r < M; r++)
+    {
+        float* f = dftFilter.ptr<float>(r);
+        const int u = (r <= M / 2) ? r : (r - M);
+        for (int c = 0; c < N; c++)
+        {
+            const int v = (c <= N / 2) ? c : (c - N);
+            f[2 * c] = H(u, v);
+            f[2 * c + 1] = 0.0f;
+        }
+    }
+}
+
+// filters for the packed CCS spectrum - create_ccs_filter() fills an M x N
+// filter with the gain H(u, v) of each packed frequency (u, v signed, origin at
+// the top left, i.e. unshifted) as a real only CCS spectrum (Im slots zero), to
+// be applied with mulSpectrums(). H must be symmetric (H(u,v) = H(-u,-v)).
+// (transfer functions are functors H(double u, double v) - see below)
+
+template<typename TransferFunction>
+inline void create_ccs_filter(cv::Mat& dftFilter, const TransferFunction& H)
+{
+    const int M = dftFilter.rows;
+    const int N = dftFilter.cols;
+    const bool evenN = ((N % 2) == 0);
+    const int pairEnd = evenN ? (N - 1) : N;    // columns [1, pairEnd) hold (Re, Im) pairs
+
+    for (int r = 0; r < M; r++)
+    {
+        float* f = dftFilter.ptr<float>(r);
+        const int u = (r <= M / 2) ? r : (r - M);
+        for (int c = 1; c < pairEnd; c += 2)
+        {
+            f[c] = H(u, (c + 1) / 2);
+            f[c + 1] = 0.0f;
+        }
+    }
+
+    // v = 0 (column 0) and v = N/2 (last column, N even only) - (Re, Im) pairs
+    // down the column for u = 1, 2 .. (Re only for u = 0 and u = M/2)
+
+    for (int i = 0; i < (evenN ? 2 : 1); i++)
+    {
+        const int col = (i == 0) ? 0 : (N - 1);
+        const int v = (i == 0) ? 0 : N / 2;
+        dftFilter.at<float>(0, col) = H(0, v);
+        for (int t = 1; 2*t - 1 < M; t++)
+        {
+            dftFilter.at<float>(2*t - 1, col) = H(t, v);
+            if (2*t < M) dftFilter.at<float>(2*t, col) = 0.0f;
+        }
+    }
+}
+
+// butterworth low-pass transfer function 1 / (1 + (D(u,v) / radius)^order)
+
+struct ButterworthLowpass
+{
+    int radius, order;
+    ButterworthLowpass(int radius, int order) : radius(radius), order(order) {}
+    float operator()(double u, double v) const
+    {
+        return (float) (1.0 / (1 + std::pow(std::sqrt(u * u + v * v) / radius, order)));
+    }
+};
+
+// create a butterworth low-pass filter with radius D, order n for a packed
+// CCS spectrum (1 channel, pre-allocated size of dftFilter specifies dimensions)
+
+inline void create_butterworth_lowpass_filter_ccs(cv::Mat& dftFilter, int radius, int order)
+{
+    create_ccs_filter(dftFilter, ButterworthLowpass(radius, order));
+}
+
+// as above for a full complex spectrum (2 channel) in unshifted layout
+
+inline void create_butterworth_lowpass_filter_unshifted(cv::Mat& dftFilter, int radius, int order)
+{
+    create_complex_filter(dftFilter, ButterworthLowpass(radius, order));
+}
+
+/******************************************************************************/
+// further transfer functions (D(u,v) the distance of frequency (u, v) from the
+// origin, all radii / widths in units of the DFT grid) - each can be used with
+// create_ccs_filter() / create_complex_filter() / frequency_filter_kernel() on
+// its own, or composed with others in a FrequencyFilterChain (below)
+
+// butterworth high-pass 1 / (1 + (radius / D(u,v))^order)
+
+struct ButterworthHighpass
+{
+    int radius, order;
+    ButterworthHighpass(int radius, int order) : radius(radius), order(order) {}
+    float operator()(double u, double v) const
+    {
+        const double d = std::sqrt(u * u + v * v);
+        return (d > 0) ? (float) (1.0 / (1 + std::pow(radius / d, order))) : 0.0f;
+    }
+};
+
+// butterworth band-reject 1 / (1 + |D(u,v) width / (D(u,v)^2 - radius^2)|^order)
+// about the ring D(u,v) = radius, or its complement the band-pass (reject = false)
+
+struct ButterworthBand
+{
+    int radius, width, order;
+    bool reject;
+    ButterworthBand(int radius, int width, int order, bool reject)
+        : radius(radius), width(width), order(order), reject(reject) {}
+    float operator()(double u, double v) const
+    {
+        const double d2 = u * u + v * v;
+        const double r2 = (double) radius * radius;
+        const double g = (d2 != r2) ? 1.0 / (1 + std::pow(std::fabs(std::sqrt(d2) * width / (d2 - r2)), order)) : 0.0;
+        return (float) (reject ? g : (1.0 - g));
+    }
+};
+
+// gaussian low-pass exp(-D(u,v)^2 / (2 radius^2)), or its complement the
+// high-pass (highpass = true)
+
+struct GaussianFilter
+{
+    int radius;
+    bool highpass;
+    GaussianFilter(int radius, bool highpass) : radius(radius), highpass(highpass) {}
+    float operator()(double u, double v) const
+    {
+        const double g = std::exp(-(u * u + v * v) / (2.0 * radius * radius));
+        return (float) (highpass ? (1.0 - g) : g);
+    }
+};
+
+// butterworth notch-reject about the frequency pair (u0, v0), (-u0, -v0) - the
+// product of two butterworth high-pass filters centred on them (removes a
+// periodic pattern such as scan lines or mains interference)
+
+struct ButterworthNotch
+{
+    int u0, v0, radius, order;
+    ButterworthNotch(int u0, int v0, int radius, int order) : u0(u0), v0(v0), radius(radius), order(order) {}
+    float operator()(double u, double v) const
+    {
+        const ButterworthHighpass hp(radius, order);
+        return hp(u - u0, v - v0) * hp(u + u0, v + v0);
+    }
+};
+
+/******************************************************************************/
+// filter chains - a cascade of filters applied one after the other is the same
+// as a single filter whose gain is the product of theirs, so a chain is
+// evaluated (per frequency) into one filter up front, and each frame then pays
+// for one forward DFT, one mulSpectrums() and one inverse DFT however many
+// filters are stacked. Stages are selected at run time (e.g. from trackbars) by
+// type; unused parameters of a stage are ignored.
+
+#define FREQUENCY_LOWPASS           0   // butterworth low-pass (radius, order)
+#define FREQUENCY_HIGHPASS          1   // butterworth high-pass (radius, order)
+#define FREQUENCY_BANDPASS          2   // butterworth band-pass (radius, width, order)
+#define FREQUENCY_BANDREJECT        3   // butterworth band-reject (radius, width, order)
+#define FREQUENCY_GAUSSIAN_LOWPASS  4   // gaussian low-pass (radius)
+#define FREQUENCY_GAUSSIAN_HIGHPASS 5   // gaussian high-pass (radius)
+#define FREQUENCY_NOTCH             6   // butterworth notch-reject (u0, v0, radius, order)
+
+struct FrequencyFilterStage
+{
+    int type;
+    int radius, order, width, u0, v0;
+
+    FrequencyFilterStage(int type, int radius, int order=2, int width=0, int u0=0, int v0=0)
+        : type(type), radius(std::max(1, radius)), order(order), width(width), u0(u0), v0(v0) {}
+
+    float operator()(double u, double v) const
+    {
+        switch (type)
+        {
+            case FREQUENCY_LOWPASS: return ButterworthLowpass(radius, order)(u, v);
+            case FREQUENCY_HIGHPASS: return ButterworthHighpass(radius, order)(u, v);
+            case FREQUENCY_BANDPASS: return ButterworthBand(radius, width, order, false)(u, v);
+            case FREQUENCY_BANDREJECT: return ButterworthBand(radius, width, order, true)(u, v);
+            case FREQUENCY_GAUSSIAN_LOWPASS: return GaussianFilter(radius, false)(u, v);
+            case FREQUENCY_GAUSSIAN_HIGHPASS: return GaussianFilter(radius, true)(u, v);
+            case FREQUENCY_NOTCH: return ButterworthNotch(u0, v0, radius, order)(u, v);
+        }
+        return 1.0f;
+    }
+
+    bool operator==(const FrequencyFilterStage& s) const
+    {
+        return (type == s.type) && (radius == s.radius) && (order == s.order) && (width == s.width)
+               && (u0 == s.u0) && (v0 == s.v0);
+    }
+};
+
+// product of the stages added (an empty chain passes everything) - itself a
+// transfer function, for create_ccs_filter() etc. or FrequencyFilterBank
+
+class FrequencyFilterChain
+{
+public:
+    FrequencyFilterChain() : sy(1.0), sx(1.0) {}
+
+    FrequencyFilterChain& add(const FrequencyFilterStage& stage)
+    {
+        stages.push_back(stage);
+        return *this;
+    }
+
+    void clear() { stages.clear(); }
+    size_t size() const { return stages.size(); }
+    bool empty() const { return stages.empty(); }
+
+    // the same chain for another DFT grid - frequency (u, v) of that grid is
+    // (u sy, v sx) of the grid the stages were defined on
+
+    FrequencyFilterChain scaled(double scaleY, double scaleX) const
+    {
+        FrequencyFilterChain c(*this);
+        c.sy *= scaleY;
+        c.sx *= scaleX;
+        return c;
+    }
+
+    float operator()(double u, double v) const
+    {
+        float g = 1.0f;
+        for (size_t i = 0; (i < stages.size()) && (g != 0.0f); i++)
+        {
+            g *= stages[i](u * sy, v * sx);
+        }
+        return g;
+    }
+
+    bool operator==(const FrequencyFilterChain& c) const
+    {
+        return (stages == c.stages) && (sy == c.sy) && (sx == c.sx);
+    }
+
+private:
+    std::vector<FrequencyFilterStage> stages;
+    double sy, sx;      // frequency scale (see scaled())
+};
+
+/******************************************************************************/
+// filter bank - caches the filters built for each (DFT size, radius, order) so
+// that a filter is only rebuilt when one of these changes (e.g. a trackbar is
+// moved), not on every frame. Any filter with the same signature as
+// create_butterworth_lowpass_filter() can be kept in the same bank - the
+// function (and the filter type - CV_32FC2 for a full complex spectrum, CV_32FC1
+// for a packed CCS one) is part of the key, and filter chains are kept keyed by
+// their stages. The least recently used filter is dropped once the bank holds
+// capacity filters.
+
+#define FREQUENCY_FILTER_BANK_SIZE 8    // default number of filters kept
+
+typedef void (*FrequencyFilterFn)(cv::Mat& dftFilter, int radius, int order);
+
+class FrequencyFilterBank
+{
+public:
+    explicit FrequencyFilterBank(size_t capacity=FREQUENCY_FILTER_BANK_SIZE)
+        : capacity(capacity), tick(0), hitCount(0), missCount(0) {}
+
+    // the filter built by create() for a size (rows x cols of the DFT image),
+    // radius, order and type - shared with the bank, so must not be modified
+
+    cv::Mat get(FrequencyFilterFn create, cv::Size size, int radius, int order, int type=CV_32FC2)
+    {
+        tick++;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            Entry& e = entries[i];
+            if ((e.create == create) && (e.size == size) && (e.radius == radius) && (e.order == order)
+                && (e.filter.type() == type))
+            {
+                e.used = tick;
+                hitCount++;
+                return e.filter;
+            }
+        }
+
+        missCount++;
+        Entry e;
+        e.create = create;
+        e.size = size;
+        e.radius = radius;
+        e.order = order;
+        e.filter.create(size, type);
+        create(e.filter, radius, order);
+        return insert(e);
+    }
+
+    // the filter for a chain (all its stages evaluated into one product) for a
+    // size and type (CV_32FC1 - packed CCS, CV_32FC2 - full complex, unshifted)
+
+    cv::Mat get(const FrequencyFilterChain& chain, cv::Size size, int type=CV_32FC2)
+    {
+        tick++;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            Entry& e = entries[i];
+            if ((e.create == NULL) && (e.size == size) && (e.filter.type() == type) && (e.chain == chain))
+            {
+                e.used = tick;
+                hitCount++;
+                return e.filter;
+            }
+        }
+
+        missCount++;
+        Entry e;
+        e.create = NULL;
+        e.size = size;
+        e.radius = e.order = 0;
+        e.chain = chain;
+        e.filter.create(size, type);
+        if (type == CV_32FC2)
+        {
+            create_complex_filter(e.filter, chain);
+        } else {
+            create_ccs_filter(e.filter, chain);
+        }
+        return insert(e);
+    }
+
+    int64 hits() const { return hitCount; }
+    int64 misses() const { return missCount; }
+    size_t size() const { return entries.size(); }
+
+    void clear()
+    {
+        entries.clear();
+        hitCount = missCount = 0;
+    }
+
+private:
+    struct Entry
+    {
+        FrequencyFilterFn create;   // (NULL for a chain)
+        cv::Size size;
+        int radius, order;
+        FrequencyFilterChain chain;
+        int64 used;         // tick of the last get() of this filter
+        cv::Mat filter;
+    };
+
+    // add a newly built filter, replacing the least recently used if full
+
+    cv::Mat insert(Entry& e)
+    {
+        e.used = tick;
+        if (entries.size() < capacity)
+        {
+            entries.push_back(e);
+        } else {
+            size_t lru = 0;
+            for (size_t i = 1; i < entries.size(); i++)
+            {
+                if (entries[i].used < entries[lru].used) lru = i;
+            }
+            entries[lru] = e;
+        }
+        return e.filter;
+    }
+
+    std::vector<Entry> entries;
+    size_t capacity;
+    int64 tick;
+    int64 hitCount, missCount;
+};
+
+/******************************************************************************/
+// colour filtering - the planes of a 3 channel (BGR) image are filtered
+// concurrently (OpenMP), each with its own DFT buffers. Planes of the same size
+// share one filter (a single bank entry), so BGR filtering costs three plane
+// DFTs and one filter build. In YCrCb mode only luma is filtered at full
+// resolution; the chroma planes - which carry little high frequency detail -
+// are filtered at 1 / FREQUENCY_CHROMA_SCALE resolution in each axis (their
+// filter scaled to the same cut-off in cycles per pixel) and resized back,
+// roughly halving the FFT work. The chain frequencies are in units of the DFT
+// grid of the full image (getOptimalDFTSize() of its rows, cols) as for a
+// grayscale image; the output is not rescaled (unlike the grayscale display).
+
+#define FREQUENCY_COLOUR_BGR    0   // B, G and R planes filtered
+#define FREQUENCY_COLOUR_YCRCB  1   // luma at full resolution, chroma reduced
+#define FREQUENCY_CHROMA_SCALE  2   // chroma resolution reduction (each axis)
+
+// filter one plane with a packed CCS filter (whose size is that of the zero
+// padded DFT), offset being subtracted before (and added back after) so that
+// the padding is neutral for it (e.g. mid range for chroma). spectrum (if
+// given) receives the filtered spectrum.
+
+inline void frequency_filter_plane(const cv::Mat& plane, cv::Mat& dest, const cv::Mat& filter,
+                                   double offset=0.0, cv::Mat* spectrum=NULL)
+{
+    cv::Mat padded, realImg, planeSpectrum;
+    cv::copyMakeBorder(plane, padded, 0, filter.rows - plane.rows, 0, filter.cols - plane.cols,
+                       cv::BORDER_CONSTANT, cv::Scalar::all(offset));
+    padded.convertTo(realImg, CV_32F, 1.0, -offset);
+
+    cv::dft(realImg, planeSpectrum);
+    cv::mulSpectrums(planeSpectrum, filter, planeSpectrum, 0);
+    if (spectrum != NULL)
+    {
+        planeSpectrum.copyTo(*spectrum);
+    }
+    cv::idft(planeSpectrum, realImg, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+    cv::Mat inside = realImg(cv::Rect(0, 0, plane.cols, plane.rows));
+    inside.convertTo(dest, plane.depth(), 1.0, offset);
+}
+
+// filter a 3 channel (BGR) image with the product of chain, its filters taken
+// from (and cached in) bank - mode FREQUENCY_COLOUR_BGR or _YCRCB. spectrum
+// (if given) receives the filtered spectrum of the first plane (B or luma).
+
+inline void frequency_filter_colour(const cv::Mat& src, cv::Mat& dest, const FrequencyFilterChain& chain,
+                                    FrequencyFilterBank& bank, int mode=FREQUENCY_COLOUR_BGR,
+                                    cv::Mat* spectrum=NULL)
+{
+    const cv::Size dftSize(cv::getOptimalDFTSize(src.cols), cv::getOptimalDFTSize(src.rows));
+    std::vector<cv::Mat> planes(3), filtered(3), filters(3);
+    double offsets[3] = { 0.0, 0.0, 0.0 };
+
+    if (mode == FREQUENCY_COLOUR_YCRCB)
+    {
+        cv::Mat ycrcb;
+        cv::cvtColor(src, ycrcb, cv::COLOR_BGR2YCrCb);
+        cv::split(ycrcb, planes);
+
+        const int s = FREQUENCY_CHROMA_SCALE;
+        const cv::Size chromaSize((src.cols + s - 1) / s, (src.rows + s - 1) / s);
+        const cv::Size chromaDFTSize(cv::getOptimalDFTSize(chromaSize.width),
+                                     cv::getOptimalDFTSize(chromaSize.height));
+        const double mid = (src.depth() == CV_8U) ? 128.0 : ((src.depth() == CV_16U) ? 32768.0 : 0.5);
+
+        filters[0] = bank.get(chain, dftSize, CV_32F);
+        filters[1] = filters[2] = bank.get(chain.scaled(
+            ((double) dftSize.height * chromaSize.height) / ((double) chromaDFTSize.height * src.rows),
+            ((double) dftSize.width * chromaSize.width) / ((double) chromaDFTSize.width * src.cols)),
+            chromaDFTSize, CV_32F);
+        for (int c = 1; c < 3; c++)
+        {
+            cv::resize(planes[c], planes[c], chromaSize, 0, 0, cv::INTER_AREA);
+            offsets[c] = mid;
+        }
+    } else {
+        cv::split(src, planes);
+        filters[0] = filters[1] = filters[2] = bank.get(chain, dftSize, CV_32F);
+    }
+
+    // (the bank is not thread safe - all the filters are fetched beforehand)
+
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < 3; c++)
+    {
+        frequency_filter_plane(planes[c], filtered[c], filters[c], offsets[c], (c == 0) ? spectrum : NULL);
+    }
+
+    if (mode == FREQUENCY_COLOUR_YCRCB)
+    {
+        cv::Mat ycrcb;
+        for (int c = 1; c < 3; c++)
+        {
+            cv::resize(filtered[c], filtered[c], src.size(), 0, 0, cv::INTER_LINEAR);
+        }
+        cv::merge(filtered, ycrcb);
+        cv::cvtColor(ycrcb, dest, cv::COLOR_YCrCb2BGR);
+    } else {
+        cv::merge(filtered, dest);
+    }
+}
+
+/******************************************************************************/
+// spatial kernel (impulse response) of a transfer function - the filters above
+// are defined on the M x N grid of a whole (padded) image DFT, e.g. radius is
+// in units of that grid. For tiled filtering they are needed as a kernel: H is
+// sampled at the same frequencies (in cycles per pixel) on a grid of (at first)
+// at most FREQUENCY_KERNEL_GRID, inverse transformed, and the result truncated
+// to the smallest centred (2R+1) x (2R+1) square holding all but epsilon of its
+// energy (so the kernel can usually be derived without an image sized DFT).
+// Should the impulse response not fit the grid (energy left outside the largest
+// square), the grid is doubled, up to the M x N of the whole image DFT. Returns
+// false if even that grid cannot hold it - the kernel is then truncated to the
+// largest square and drops more than epsilon of the energy.
+
+#define FREQUENCY_KERNEL_GRID 1024        // initial grid the kernel is derived on
+#define FREQUENCY_KERNEL_EPSILON 1e-6     // fraction of kernel energy dropped
+
+// H with its frequencies scaled from one grid to another
+
+template<typename TransferFunction>
+struct ScaledTransferFunction
+{
+    const TransferFunction& H;
+    double sy, sx;
+    ScaledTransferFunction(const TransferFunction& H, double sy, double sx) : H(H), sy(sy), sx(sx) {}
+    float operator()(double u, double v) const { return H(u * sy, v * sx); }
+};
+
+// impulse response of H on an M x N grid (h) and the radius R of the smallest
+// square holding all but epsilon of its energy (false if none within the grid)
+
+template<typename TransferFunction>
+inline bool frequency_filter_kernel_grid(cv::Mat& h, int& R, int M, int N, cv::Size dftSize,
+                                         const TransferFunction& H, double epsilon)
+{
+    cv::Mat f(M, N, CV_32F);
+    create_ccs_filter(f, ScaledTransferFunction<TransferFunction>(H, (double) dftSize.height / M,
+                                                                  (double) dftSize.width / N));
+    cv::idft(f, h, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+    // energy of each square ring max(|dy|, |dx|) = r about the origin (top
+    // left, wrapped around)
+
+    std::vector<double> ring(std::max(M, N) / 2 + 1, 0.0);
+    double total = 0.0;
+    for (int r = 0; r < M; r++)
+    {
+        const int dy = std::min(r, M - r);
+        const float* hr = h.ptr<float>(r);
+        for (int c = 0; c < N; c++)
+        {
+            const double e = (double) hr[c] * hr[c];
+            ring[std::max(dy, std::min(c, N - c))] += e;
+            total += e;
+        }
+    }
+
+    const int maxR = std::max(0, std::min(M, N) / 2 - 1);
+    R = 0;
+    double inside = ring[0];
+    while ((R < maxR) && (total - inside > epsilon * total))
+    {
+        inside += ring[++R];
+    }
+    return (total - inside <= epsilon * total);
+}
+
+template<typename TransferFunction>
+inline bool frequency_filter_kernel(cv::Mat& kernel, cv::Size dftSize, const TransferFunction& H,
+                                    double epsilon=FREQUENCY_KERNEL_EPSILON)
+{
+    int M = std::min(dftSize.height, FREQUENCY_KERNEL_GRID);
+    int N = std::min(dftSize.width, FREQUENCY_KERNEL_GRID);
+
+    cv::Mat h;
+    int R = 0;
+    bool fits = frequency_filter_kernel_grid(h, R, M, N, dftSize, H, epsilon);
+    while (!fits && ((M < dftSize.height) || (N < dftSize.width)))
+    {
+        M = std::min(dftSize.height, cv::getOptimalDFTSize(2 * M));
+        N = std::min(dftSize.width, cv::getOptimalDFTSize(2 * N));
+        fits = frequency_filter_kernel_grid(h, R, M, N, dftSize, H, epsilon);
+    }
+
+    kernel.create(2 * R + 1, 2 * R + 1, CV_32F);
+    for (int dy = -R; dy <= R; dy++)
+    {
+        for (int dx = -R; dx <= R; dx++)
+        {
+            kernel.at<float>(dy + R, dx + R) = h.at<float>((dy + M) % M, (dx + N) % N);
+        }
+    }
+    return fits;
+}
+
+/******************************************************************************/
+// tiled (overlap-save) engine - convolves an image with a (2R+1) x (2R+1)
+// kernel tile by tile: each T x T tile of the zero padded input is transformed
+// (real input dft()), multiplied by the kernel spectrum and inverse transformed,
+// and the (T-2R) x (T-2R) centre of the result - the part free of circular
+// wrap around - is written out. Tiles are filtered in parallel (OpenMP), each
+// thread reusing its own tile buffers, and T is chosen for cache (see
+// tileSizeFor()). The output is the linear, zero padded convolution with the
+// (truncated) kernel - applyMonolithic() computes the same with one whole image
+// DFT, as a reference for the tiling only. It is not the circular whole image
+// filtering of butterworth_lowpass.cpp: the two differ at the borders and by
+// the energy dropped when the kernel was truncated (see butterworth_stream.cpp
+// --check). applyStream() produces the output in horizontal bands, so images
+// larger than memory can be filtered (as nonlocalMeansFilterStream() in nlm.hpp).
+
+#define FREQUENCY_TILE_CACHE_BYTES (1024*1024)  // cache budget for a tile's buffers
+
+class TiledFrequencyFilter
+{
+public:
+    TiledFrequencyFilter() : R(0), T(0) {}
+
+    // set the kernel (square, odd size) and the tile DFT size (0 = chosen for
+    // cache by tileSizeFor())
+
+    void setKernel(const cv::Mat& k, int tileSize=0)
+    {
+        k.convertTo(kernel, CV_32F);
+        R = kernel.rows / 2;
+        T = (tileSize > 0) ? cv::getOptimalDFTSize(std::max(tileSize, 2 * R + 1)) : tileSizeFor(R);
+        kernelSpectrum(T, T, tileKernel);
+    }
+
+    int radius() const { return R; }
+    int tileSize() const { return T; }
+
+    // tile size for a kernel of radius R - the DFT size minimising the work per
+    // output pixel (T^2 log T / (T-2R)^2) among those whose two T x T float
+    // buffers fit FREQUENCY_TILE_CACHE_BYTES (or up to 8R for kernels too large
+    // for that, where bigger tiles always win)
+
+    static int tileSizeFor(int R)
+    {
+        const int cacheT = (int) std::sqrt(FREQUENCY_TILE_CACHE_BYTES / (2.0 * sizeof(float)));
+        const int maxT = std::max(cacheT, 8 * R);
+        int best = cv::getOptimalDFTSize(2 * R + 16);
+        double bestCost = DBL_MAX;
+        for (int t = best; t <= maxT; t = cv::getOptimalDFTSize(t + 1))
+        {
+            const double s = t - 2 * R;
+            const double cost = (double) t * t * std::log((double) t) / (s * s);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                best = t;
+            }
+        }
+        return best;
+    }
+
+    // filter src (1 channel, any depth) into dest (same size, depth ddepth or
+    // that of src if < 0), tile by tile
+
+    void apply(const cv::Mat& src, cv::Mat& dest, int ddepth=-1) const
+    {
+        cv::Mat srcFloat, padded, out;
+        src.convertTo(srcFloat, CV_32F);
+        cv::copyMakeBorder(srcFloat, padded, R, R, R, R, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+        filterPadded(padded, out);
+        out.convertTo(dest, (ddepth < 0) ? src.depth() : ddepth);
+    }
+
+    // the same convolution with one whole image DFT (reference)
+
+    void applyMonolithic(const cv::Mat& src, cv::Mat& dest, int ddepth=-1) const
+    {
+        const int M = cv::getOptimalDFTSize(src.rows + 2 * R);
+        const int N = cv::getOptimalDFTSize(src.cols + 2 * R);
+        cv::Mat padded = cv::Mat::zeros(M, N, CV_32F), spectrum, K;
+        cv::Mat inside = padded(cv::Rect(R, R, src.cols, src.rows));
+        src.convertTo(inside, CV_32F);
+
+        kernelSpectrum(M, N, K);
+        cv::dft(padded, spectrum);
+        cv::mulSpectrums(spectrum, K, spectrum, 0);
+        cv::idft(spectrum, padded, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+        padded(cv::Rect(R, R, src.cols, src.rows)).convertTo(dest, (ddepth < 0) ? src.depth() : ddepth);
+    }
+
+    // streaming version of apply() - the image is pulled from a row source in
+    // bands of bandRows rows (+ R rows above and below) and each filtered band
+    // handed to the row sink. Source must provide rows(), cols(), type() and
+    // bool read(cv::Mat& rows, int n); Sink must provide write(const cv::Mat&
+    // rows) (see pnm_stream.hpp). Returns false if the source could not be
+    // read (or is not 1 channel).
+
+    template<typename Source, typename Sink>
+    bool applyStream(Source& in, Sink& out, int bandRows=256) const
+    {
+        const int rows = in.rows();
+        const int cols = in.cols();
+        const int type = in.type();
+        if (CV_MAT_CN(type) != 1) return false;
+        bandRows = std::max(1, std::min(bandRows, rows));
+
+        // source window holding rows [lo,hi) and the zero padded band - both
+        // allocated once
+
+        cv::Mat window(bandRows + 2 * R, cols, type);
+        cv::Mat paddedBuf(bandRows + 2 * R, cols + 2 * R, CV_32F);
+        cv::Mat rowsIn, band, result;
+        int lo = 0, hi = 0;
+
+        for (int y0 = 0; y0 < rows; y0 += bandRows)
+        {
+            const int y1 = std::min(y0 + bandRows, rows);
+            const int needLo = std::max(0, y0 - R);
+            const int needHi = std::min(rows, y1 + R);
+
+            // drop the rows no longer needed, pull the new ones from the source
+
+            if (needLo > lo)
+            {
+                const int keep = std::max(0, hi - needLo);
+                if (keep > 0)
+                {
+                    window.rowRange(hi - keep - lo, hi - lo).copyTo(rowsIn);   // (may overlap)
+                    rowsIn.copyTo(window.rowRange(0, keep));
+                }
+                lo = needLo;
+                hi = std::max(hi, lo);
+            }
+            if (needHi > hi)
+            {
+                cv::Mat newRows = window.rowRange(hi - lo, needHi - lo);
+                if (!in.read(newRows, needHi - hi)) return false;
+                hi = needHi;
+            }
+
+            // padded band - image rows y0-R .. y1+R (zero outside the image)
+
+            cv::Mat padded = paddedBuf.rowRange(0, y1 - y0 + 2 * R);
+            padded.setTo(cv::Scalar::all(0));
+            cv::Mat inside = padded(cv::Rect(R, needLo - (y0 - R), cols, needHi - needLo));
+            window.rowRange(needLo - lo, needHi - lo).convertTo(inside, CV_32F);
+
+            filterPadded(padded, band);
+            band.convertTo(result, CV_MAT_DEPTH(type));
+            out.write(result);
+        }
+        return true;
+    }
+
+private:
+
+    // spectrum (packed CCS) of the kernel wrapped around the origin of an
+    // M x N grid
+
+    void kernelSpectrum(int M, int N, cv::Mat& spectrum) const
+    {
+        cv::Mat wrapped = cv::Mat::zeros(M, N, CV_32F);
+        for (int dy = -R; dy <= R; dy++)
+        {
+            for (int dx = -R; dx <= R; dx++)
+            {
+                wrapped.at<float>((dy + M) % M, (dx + N) % N) = kernel.at<float>(dy + R, dx + R);
+            }
+        }
+        cv::dft(wrapped, spectrum);
+    }
+
+    // overlap-save over a padded image (R rows / cols of context on each side)
+    // into dest (padded size - 2R, CV_32F)
+
+    void filterPadded(const cv::Mat& padded, cv::Mat& dest) const
+    {
+        const int rows = padded.rows - 2 * R;
+        const int cols = padded.cols - 2 * R;
+        const int S = T - 2 * R;                // output rows / cols per tile
+        const int tilesX = (cols + S - 1) / S;
+        const int tilesY = (rows + S - 1) / S;
+
+        dest.create(rows, cols, CV_32F);
+
+#pragma omp parallel
+        {
+            cv::Mat tile(T, T, CV_32F), spectrum;   // per thread, reused for every tile
+
+#pragma omp for schedule(dynamic)
+            for (int t = 0; t < tilesX * tilesY; t++)
+            {
+                const int oy = (t / tilesX) * S;
+                const int ox = (t % tilesX) * S;
+                const int h = std::min(T, padded.rows - oy);
+                const int w = std::min(T, padded.cols - ox);
+
+                if ((h < T) || (w < T)) tile.setTo(cv::Scalar::all(0));
+                padded(cv::Rect(ox, oy, w, h)).copyTo(tile(cv::Rect(0, 0, w, h)));
+
+                cv::dft(tile, spectrum);
+                cv::mulSpectrums(spectrum, tileKernel, spectrum, 0);
+                cv::idft(spectrum, tile, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+                const int oh = std::min(S, rows - oy);
+                const int ow = std::min(S, cols - ox);
+                tile(cv::Rect(R, R, ow, oh)).copyTo(dest(cv::Rect(ox, oy, ow, oh)));
+            }
+        }
+    }
+
+    cv::Mat kernel;         // (2R+1) x (2R+1) kernel
+    cv::Mat tileKernel;     // its spectrum for a T x T tile
+    int R;                  // kernel radius
+    int T;                  // tile DFT size
+};
+
+/******************************************************************************/
+
+#endif
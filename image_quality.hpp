@@ -0,0 +1,239 @@
+// Image quality metrics (MSE / PSNR / SSIM) of a processed image against a
+// reference - shared by the denoising examples (nlm.cpp / nlm2.cpp / ...)
+
+// All three metrics are computed for every channel in one parallel pass over
+// the two images (no intermediate copies / colour conversions): rows are
+// processed in groups of IQ_CELL, accumulating per column integer sums of
+// x, y, x^2, y^2 and xy (a contiguous loop the compiler vectorises), which are
+// reduced to IQ_CELL x IQ_CELL cell sums. The squared error of each cell is
+// exact from these sums, and SSIM uses 2 x 2 cell (8 x 8 pixel) windows at a
+// stride of one cell (4 pixels) with the usual constants of:
+
+// Z. Wang, A.C. Bovik, H.R. Sheikh, E.P. Simoncelli, "Image quality assessment:
+// from error visibility to structural similarity", IEEE Transactions on Image
+// Processing, 13(4), pp: 600-612, 2004.
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#ifndef IMAGE_QUALITY_HPP
+#define IMAGE_QUALITY_HPP
+
+#include "opencv2/core.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <vector>		// standard C++ containers
+#include <algorithm>    // includes min()
+#include <cmath>        // includes log10()
+
+#ifdef _OPENMP
+    #include <omp.h>    // OpenMP thread numbering
+#endif
+
+#define IQ_MAX_CHANNELS 4
+#define IQ_CELL 4                   // cell size (SSIM window = 2 x 2 cells)
+
+/******************************************************************************/
+
+struct ImageQuality
+{
+    int channels;
+    double mse;             // mean squared error (mean over channels)
+    double psnr;            // peak signal to noise ratio (dB) of mse (0 if identical)
+    double ssim;            // structural similarity (mean over channels)
+    double channelMSE[IQ_MAX_CHANNELS];
+    double channelPSNR[IQ_MAX_CHANNELS];
+    double channelSSIM[IQ_MAX_CHANNELS];
+};
+
+inline std::ostream& operator<<(std::ostream& out, const ImageQuality& q)
+{
+    return out<<"MSE "<<q.mse<<", PSNR "<<q.psnr<<" dB, SSIM "<<q.ssim;
+}
+
+// PSNR (dB) of an 8-bit mean squared error (0 for identical images)
+
+inline double iqPSNR(double mse)
+{
+    return (mse==0.0) ? 0.0 : 10.0*log10((255.0*255.0)/mse);
+}
+
+// SSIM of one window from its sums over n pixels
+
+inline double iqSSIM(double n, double sx, double sy, double sxx, double syy, double sxy)
+{
+    const double C1 = (0.01*255)*(0.01*255);
+    const double C2 = (0.03*255)*(0.03*255);
+    const double mx = sx/n, my = sy/n;
+    const double vx = sxx/n-mx*mx, vy = syy/n-my*my, cxy = sxy/n-mx*my;
+    return ((2*mx*my+C1)*(2*cxy+C2))/((mx*mx+my*my+C1)*(vx+vy+C2));
+}
+
+// accumulate one row of a / b into the per column sums (restrict: lets the
+// compiler vectorise without alias checks)
+
+inline void iqAccumulateRow(const uchar* __restrict pa, const uchar* __restrict pb, int n,
+                            int* __restrict sx, int* __restrict sy, int* __restrict sxx,
+                            int* __restrict syy, int* __restrict sxy)
+{
+    for(int k=0;k<n;k++)
+    {
+        const int x = pa[k], y = pb[k];
+        sx[k] += x; sy[k] += y;
+        sxx[k] += x*x; syy[k] += y*y; sxy[k] += x*y;
+    }
+}
+
+/******************************************************************************/
+// MSE / PSNR / SSIM of b against reference a (8-bit, same size / channels)
+
+inline ImageQuality computeImageQuality(const cv::Mat& a, const cv::Mat& b)
+{
+    CV_Assert((a.size()==b.size()) && (a.type()==b.type()) && (a.depth()==CV_8U)
+              && (a.channels()<=IQ_MAX_CHANNELS));
+
+    const int cn = a.channels();
+    const int cellRows = a.rows/IQ_CELL;
+    const int cellCols = a.cols/IQ_CELL;
+    const int winRows = std::max(0, cellRows-1);
+    const int winCols = std::max(0, cellCols-1);
+    const int W = cellCols*IQ_CELL*cn;          // row elements covered by cells
+    const int C = cellCols*cn;                  // cell sums per cell row
+
+    int64 sse[IQ_MAX_CHANNELS];
+    double ssimSum[IQ_MAX_CHANNELS];
+    for(int c=0;c<cn;c++){ sse[c]=0; ssimSum[c]=0.0; }
+
+#pragma omp parallel
+    {
+#ifdef _OPENMP
+        const int tid = omp_get_thread_num();
+        const int nthreads = omp_get_num_threads();
+#else
+        const int tid = 0;
+        const int nthreads = 1;
+#endif
+        // this thread owns cell rows [c0,c1) - and also computes row c1 (if any)
+        // for the windows whose top cell row is c1-1
+
+        const int c0 = (int) ((int64) cellRows*tid/nthreads);
+        const int c1 = (int) ((int64) cellRows*(tid+1)/nthreads);
+        const int last = std::min(c1, cellRows-1);
+
+        // per column sums (5 x W) + cell sums of the previous / current cell row (2 x 5 x C)
+
+        std::vector<int> buf(5*W+10*C+1);
+        int* col = &buf[0];
+        int* cells[2] = { &buf[5*W], &buf[5*W+5*C] };
+
+        int64 tsse[IQ_MAX_CHANNELS];
+        double tssim[IQ_MAX_CHANNELS];
+        for(int c=0;c<cn;c++){ tsse[c]=0; tssim[c]=0.0; }
+
+        for(int cy=c0;cy<=last;cy++)
+        {
+            int* sx = col; int* sy = col+W; int* sxx = col+2*W; int* syy = col+3*W; int* sxy = col+4*W;
+            for(int k=0;k<5*W;k++) col[k]=0;
+            for(int r=0;r<IQ_CELL;r++)
+                iqAccumulateRow(a.ptr(cy*IQ_CELL+r), b.ptr(cy*IQ_CELL+r), W, sx, sy, sxx, syy, sxy);
+
+            // cell sums (per cell and channel) of this cell row
+
+            int* cur = cells[cy&1];
+            for(int cx=0;cx<cellCols;cx++)
+            {
+                for(int c=0;c<cn;c++)
+                {
+                    int v[5] = { 0, 0, 0, 0, 0 };
+                    for(int p=0;p<IQ_CELL;p++)
+                    {
+                        const int k = (cx*IQ_CELL+p)*cn+c;
+                        v[0] += sx[k]; v[1] += sy[k]; v[2] += sxx[k]; v[3] += syy[k]; v[4] += sxy[k];
+                    }
+                    for(int s=0;s<5;s++) cur[s*C+cx*cn+c] = v[s];
+                    if(cy<c1) tsse[c] += (int64) v[2]+v[3]-2*(int64) v[4];
+                }
+            }
+
+            // SSIM windows with top cell row cy-1
+
+            if(cy>c0)
+            {
+                const int* prev = cells[(cy-1)&1];
+                for(int cx=0;cx<winCols;cx++)
+                {
+                    for(int c=0;c<cn;c++)
+                    {
+                        double v[5];
+                        for(int s=0;s<5;s++)
+                        {
+                            const int k = s*C+cx*cn+c;
+                            v[s] = (double) prev[k]+prev[k+cn]+cur[k]+cur[k+cn];
+                        }
+                        tssim[c] += iqSSIM(4*IQ_CELL*IQ_CELL, v[0], v[1], v[2], v[3], v[4]);
+                    }
+                }
+            }
+        }
+
+#pragma omp critical
+        for(int c=0;c<cn;c++){ sse[c] += tsse[c]; ssimSum[c] += tssim[c]; }
+    }
+
+    // squared error of the pixels not covered by cells (right / bottom edges)
+
+    for(int j=0;j<a.rows;j++)
+    {
+        const uchar* pa = a.ptr(j);
+        const uchar* pb = b.ptr(j);
+        for(int k=(j<cellRows*IQ_CELL) ? W : 0;k<a.cols*cn;k++)
+        {
+            const int d = pa[k]-pb[k];
+            sse[k%cn] += d*d;
+        }
+    }
+
+    // images too small for a single SSIM window - use the whole image
+
+    if((winRows==0) || (winCols==0))
+    {
+        for(int c=0;c<cn;c++)
+        {
+            double v[5] = { 0, 0, 0, 0, 0 };
+            for(int j=0;j<a.rows;j++)
+            {
+                const uchar* pa = a.ptr(j);
+                const uchar* pb = b.ptr(j);
+                for(int i=0;i<a.cols;i++)
+                {
+                    const double x = pa[i*cn+c], y = pb[i*cn+c];
+                    v[0] += x; v[1] += y; v[2] += x*x; v[3] += y*y; v[4] += x*y;
+                }
+            }
+            ssimSum[c] = iqSSIM((double) a.rows*a.cols, v[0], v[1], v[2], v[3], v[4]);
+        }
+    }
+
+    ImageQuality q;
+    q.channels = cn;
+    q.mse = 0.0;
+    q.ssim = 0.0;
+    const double npix = (double) a.rows*a.cols;
+    const double nwin = ((winRows==0) || (winCols==0)) ? 1.0 : (double) winRows*winCols;
+    for(int c=0;c<IQ_MAX_CHANNELS;c++)
+    {
+        q.channelMSE[c] = (c<cn) ? sse[c]/npix : 0.0;
+        q.channelPSNR[c] = (c<cn) ? iqPSNR(q.channelMSE[c]) : 0.0;
+        q.channelSSIM[c] = (c<cn) ? ssimSum[c]/nwin : 0.0;
+        q.mse += q.channelMSE[c]/cn;
+        q.ssim += q.channelSSIM[c]/cn;
+    }
+    q.psnr = iqPSNR(q.mse);
+    return q;
+}
+
+/******************************************************************************/
+
+#endif
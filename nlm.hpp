@@ -0,0 +1,2250 @@
+// Non Local Means (NLM) filter - shared implementation for nlm.cpp / nlm2.cpp
+
+// Non Local Mean - lifted directly from: http://opencv.jp/opencv2-x-samples/non-local-means-filter
+// Code Credit: @fukushima1981(Twitter)
+// Code provided "as is" from original source
+
+// Reference:
+// A. Buades, B. Coll, J.M. Morel “A non local algorithm for image denoising”
+// IEEE Computer Vision and Pattern Recognition 2005, Vol 2, pp: 60-65, 2005.
+
+// This version (minor fixes + additional engines):
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2010 School of Engineering, Cranfield University
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#ifndef NLM_HPP
+#define NLM_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <vector>		// standard C++ containers
+#include <algorithm>    // includes max()
+#include <climits>      // includes INT_MAX
+#include <cfloat>       // includes FLT_MAX
+#include <cmath>        // includes exp()
+#include <cstring>      // includes memset()
+
+#ifdef _OPENMP
+    #include <omp.h>    // OpenMP thread numbering
+#endif
+
+/******************************************************************************/
+// create the (squared distance -> weight) look up table shared by all the NLM
+// engines - weights are zero beyond the returned index emax, the first index
+// where the weight drops below minWeight
+
+#define NLM_MIN_WEIGHT 0.001        // smallest non-zero weight in the table
+
+inline int createNLMWeightTable(std::vector<double>& weight, int channels, double h, double sigma=0.0,
+                                double minWeight=NLM_MIN_WEIGHT)
+{
+    weight.resize(256*256*channels);
+    double* w = &weight[0];
+    const double gauss_sd = (sigma == 0.0) ? h :sigma;
+    double gauss_color_coeff = -(1.0/(double)(channels))*(1.0/(h*h));
+    int emax = INT_MAX;
+    for(int i = 0; i < 256*256*channels; i++ )
+    {
+        double v = std::exp( std::max(i-2.0*gauss_sd*gauss_sd,0.0)*gauss_color_coeff);
+        w[i] = v;
+        if(v<minWeight)
+        {
+            emax=i;
+            break;
+        }
+    }
+    for(int i = emax; i < 256*256*channels; i++ )w[i] = 0.0;
+
+    return emax;
+}
+
+/******************************************************************************/
+// pruning - a candidate whose (partial) template distance reaches the cutoff
+// can only get a zero weight, so its distance computation can stop early at the
+// end of any template row (NLM_PRUNE flag) without changing the output. Raising
+// minWeight moves the cutoff in (weight-cutoff pruning) trading PSNR for speed.
+
+struct NLMPruneStats
+{
+    int64 candidates;       // number of candidate templates considered
+    int64 pruned;           // number of those terminated early by the cutoff
+};
+
+inline NLMPruneStats& nlmPruneStats()
+{
+    static NLMPruneStats stats = { 0, 0 };
+    return stats;
+}
+
+inline NLMPruneStats getNLMPruneStats() { return nlmPruneStats(); }
+
+inline void resetNLMPruneStats()
+{
+    nlmPruneStats().candidates = 0;
+    nlmPruneStats().pruned = 0;
+}
+
+// smallest template distance (sum over the tD template pixels) that maps to a
+// zero weight, i.e. to a table index >= emax
+
+inline int nlmDistanceCutoff(int emax, int tD)
+{
+    if(emax==INT_MAX) return INT_MAX;
+    const double tdiv = 1.0/(double)(tD);//templete square div
+    int e = std::max(0, (emax-1)*tD);
+    while((int) (e*tdiv)<emax) e++;
+    return e;
+}
+
+/******************************************************************************/
+// per-thread scratch arenas - each worker thread owns a set of cache aligned
+// buffers (slots) that are reused across rows, calls and video frames, and only
+// grown from the heap when a larger buffer is requested, so in steady state the
+// NLM engines perform no scratch allocations (see getNLMScratchStats()). Arenas
+// belong to the (OS) thread rather than to its OpenMP thread number, so that
+// several filters may run concurrently from different threads (nlm_batch.cpp);
+// an arena is a thread_local object, freed and unregistered when its thread exits.
+
+#define NLM_SCRATCH_SLOTS 4         // independent buffers per thread
+#define NLM_SCRATCH_ALIGN 64        // cache line alignment of each buffer
+
+struct NLMScratchStats
+{
+    int64 requests;         // number of scratch buffer requests
+    int64 allocations;      // number of requests that had to (re)allocate
+    int64 bytes;            // total bytes currently held by all arenas
+};
+
+class NLMScratchArena;
+
+// registry of the live arenas + the counters of arenas whose thread has exited
+// (guarded by the nlm_scratch_arenas critical section)
+
+struct NLMScratchRegistry
+{
+    std::vector<NLMScratchArena*> arenas;
+    int64 retiredRequests;
+    int64 retiredAllocations;
+};
+
+inline NLMScratchRegistry& nlmScratchRegistry()
+{
+    static NLMScratchRegistry registry = { std::vector<NLMScratchArena*>(), 0, 0 };
+    return registry;
+}
+
+class NLMScratchArena
+{
+public:
+    NLMScratchArena() : requests(0), allocations(0), bytes(0)
+    {
+        for(int i=0;i<NLM_SCRATCH_SLOTS;i++){ buffers[i]=NULL; sizes[i]=0; }
+#pragma omp critical(nlm_scratch_arenas)
+        nlmScratchRegistry().arenas.push_back(this);
+    }
+    ~NLMScratchArena()
+    {
+#pragma omp critical(nlm_scratch_arenas)
+        {
+            NLMScratchRegistry& registry = nlmScratchRegistry();
+            registry.arenas.erase(std::remove(registry.arenas.begin(), registry.arenas.end(), this),
+                                  registry.arenas.end());
+            registry.retiredRequests += requests;
+            registry.retiredAllocations += allocations;
+        }
+        for(int i=0;i<NLM_SCRATCH_SLOTS;i++) cv::fastFree(buffers[i]);
+    }
+
+    // return buffer (slot) holding at least count elements of type T
+    // (counters are updated atomically as getNLMScratchStats() may read them
+    // from another thread)
+
+    template<typename T> T* get(int slot, size_t count)
+    {
+        const size_t size = count*sizeof(T);
+#pragma omp atomic
+        requests++;
+        if(size>sizes[slot])
+        {
+            cv::fastFree(buffers[slot]);
+            const size_t grown = cv::alignSize(size, NLM_SCRATCH_ALIGN);
+#pragma omp atomic
+            bytes += (int64) (grown-sizes[slot]);
+            sizes[slot] = grown;
+            buffers[slot] = cv::fastMalloc(sizes[slot]);
+#pragma omp atomic
+            allocations++;
+        }
+        return (T*) buffers[slot];
+    }
+
+    int64 requests, allocations, bytes;
+    void* buffers[NLM_SCRATCH_SLOTS];
+    size_t sizes[NLM_SCRATCH_SLOTS];
+
+private:
+    NLMScratchArena(const NLMScratchArena&);
+    NLMScratchArena& operator=(const NLMScratchArena&);
+};
+
+inline int nlmThreadNum()
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+// arena of the calling thread (created and registered on first use)
+
+inline NLMScratchArena& nlmScratchArena()
+{
+    static thread_local NLMScratchArena arena;
+    return arena;
+}
+
+// counters summed over all arenas, including those of threads that have exited
+// (bytes only counts live arenas); safe to call while filters are running, the
+// sum is then a snapshot that may lag the running filters by a few requests
+
+inline NLMScratchStats getNLMScratchStats()
+{
+    NLMScratchStats stats = { 0, 0, 0 };
+#pragma omp critical(nlm_scratch_arenas)
+    {
+        const NLMScratchRegistry& registry = nlmScratchRegistry();
+        stats.requests = registry.retiredRequests;
+        stats.allocations = registry.retiredAllocations;
+        for(size_t a=0;a<registry.arenas.size();a++)
+        {
+            int64 requests, allocations, bytes;
+#pragma omp atomic read
+            requests = registry.arenas[a]->requests;
+#pragma omp atomic read
+            allocations = registry.arenas[a]->allocations;
+#pragma omp atomic read
+            bytes = registry.arenas[a]->bytes;
+            stats.requests += requests;
+            stats.allocations += allocations;
+            stats.bytes += bytes;
+        }
+    }
+    return stats;
+}
+
+/******************************************************************************/
+// 3 channel (interleaved BGR) template distance kernels used by the colour branch
+// of nonlocalMeansFilter(). Each kernel computes the L2 template distance for
+// NLM_PATCH_OFFSETS horizontally adjacent search offsets (candidate q starts at
+// s + 3*q) in one pass, so every template row loaded is reused across them.
+
+// The SIMD kernels may read up to 16 bytes past the end of the last template
+// row, so the bordered image they walk must be followed by one spare row.
+
+// Once every candidate's partial distance reaches cutoff at the end of a template
+// row the pass stops early (INT_MAX = never); the returned bit mask flags the
+// candidates that were pruned that way (their e[] holds the partial distance).
+
+#define NLM_PATCH_OFFSETS 4
+
+typedef int (*NLMPatchDistanceFn)(const uchar* t, const uchar* s, size_t step,
+                                  int templeteWindowSize, int* e, int cutoff);
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+    #define NLM_HAVE_AVX2 1
+    #include <immintrin.h>
+#else
+    #define NLM_HAVE_AVX2 0
+#endif
+
+#if (defined(__ARM_NEON) && defined(__aarch64__))
+    #define NLM_HAVE_NEON 1
+    #include <arm_neon.h>
+#else
+    #define NLM_HAVE_NEON 0
+#endif
+
+// lane masks for the partial (< 16 byte) chunk at the end of a template row
+
+static const short nlm_lane_mask16[32] = { -1, -1, -1, -1, -1, -1, -1, -1,
+                                           -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0,  0,  0,  0,  0,  0,  0,  0,
+                                            0,  0,  0,  0,  0,  0,  0,  0 };
+
+// scalar reference (the original colour template loop) for a single offset
+
+inline int nlmPatchDistance3(const uchar* t, const uchar* s, size_t step, int templeteWindowSize,
+                             int cutoff=INT_MAX, bool* pruned=NULL)
+{
+    const int cstep = (int) step-templeteWindowSize*3;
+    int e=0;
+    for(int n=templeteWindowSize;n--;)
+    {
+        for(int m=templeteWindowSize;m--;)
+        {
+            // computing color L2 norm
+            e += (s[0]-t[0])*(s[0]-t[0])+(s[1]-t[1])*(s[1]-t[1])+(s[2]-t[2])*(s[2]-t[2]);//L2 norm
+            s+=3,t+=3;
+        }
+        t+=cstep;
+        s+=cstep;
+        if(n && (e>=cutoff))
+        {
+            if(pruned) *pruned = true;
+            break;
+        }
+    }
+    return e;
+}
+
+// kernels are templated on the template width TW (0 = runtime templeteWindowSize)
+// so the specialised instances further below get fixed size loops
+
+template<int TW>
+inline int nlmPatchDistance3Scalar(const uchar* t, const uchar* s, size_t step,
+                                   int templeteWindowSize, int* e, int cutoff)
+{
+    int prunedMask = 0;
+    for(int q=0;q<NLM_PATCH_OFFSETS;q++)
+    {
+        bool pruned = false;
+        e[q] = nlmPatchDistance3(t, s+3*q, step, TW ? TW : templeteWindowSize, cutoff, &pruned);
+        if(pruned) prunedMask |= (1<<q);
+    }
+    return prunedMask;
+}
+
+#if NLM_HAVE_AVX2
+
+// AVX2: 16 bytes of a template row per step widened to 16 x int16, differences
+// squared and pair-summed into int32 lanes with _mm256_madd_epi16
+
+// horizontal sums of the four candidate accumulators -> one lane each
+
+__attribute__((target("avx2")))
+inline __m128i nlmHorizontalSum4AVX2(__m256i acc0, __m256i acc1, __m256i acc2, __m256i acc3)
+{
+    __m256i s = _mm256_hadd_epi32(_mm256_hadd_epi32(acc0, acc1), _mm256_hadd_epi32(acc2, acc3));
+    return _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+}
+
+template<int TW>
+__attribute__((target("avx2")))
+inline int nlmPatchDistance3AVX2(const uchar* t, const uchar* s, size_t step,
+                                 int templeteWindowSize, int* e, int cutoff)
+{
+    if(TW) templeteWindowSize = TW;
+    const int rowBytes = templeteWindowSize*3;
+    const int tail = rowBytes & 15;
+    const __m256i mask = _mm256_loadu_si256((const __m256i*) (nlm_lane_mask16 + 16 - tail));
+    const __m128i cutoffv = _mm_set1_epi32(cutoff);
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    __m256i acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+
+    for(int n=templeteWindowSize;n--;)
+    {
+        for(int b=0;b<rowBytes;b+=16)
+        {
+            __m256i tv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (t+b)));
+            __m256i d0 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (s+b))), tv);
+            __m256i d1 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (s+b+3))), tv);
+            __m256i d2 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (s+b+6))), tv);
+            __m256i d3 = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (s+b+9))), tv);
+            if(b+16>rowBytes)
+            {
+                d0 = _mm256_and_si256(d0, mask); d1 = _mm256_and_si256(d1, mask);
+                d2 = _mm256_and_si256(d2, mask); d3 = _mm256_and_si256(d3, mask);
+            }
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(d0, d0));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(d1, d1));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(d2, d2));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(d3, d3));
+        }
+        t+=step;
+        s+=step;
+        if(n && (cutoff!=INT_MAX))
+        {
+            const __m128i partial = nlmHorizontalSum4AVX2(acc0, acc1, acc2, acc3);
+            if(!_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(cutoffv, partial))))
+            {
+                _mm_storeu_si128((__m128i*) e, partial);
+                return (1<<NLM_PATCH_OFFSETS)-1;
+            }
+        }
+    }
+    _mm_storeu_si128((__m128i*) e, nlmHorizontalSum4AVX2(acc0, acc1, acc2, acc3));
+    return 0;
+}
+
+#endif
+
+#if NLM_HAVE_NEON
+
+// NEON: widening subtract (vsubl_u8) then widening multiply-accumulate (vmlal_s16)
+
+inline int32x4_t nlmSquareAccumulateNEON(int32x4_t acc, int16x8_t d)
+{
+    acc = vmlal_s16(acc, vget_low_s16(d), vget_low_s16(d));
+    return vmlal_s16(acc, vget_high_s16(d), vget_high_s16(d));
+}
+
+template<int TW>
+inline int nlmPatchDistance3NEON(const uchar* t, const uchar* s, size_t step,
+                                 int templeteWindowSize, int* e, int cutoff)
+{
+    if(TW) templeteWindowSize = TW;
+    const int rowBytes = templeteWindowSize*3;
+    const int tail = rowBytes & 15;
+    const int16x8_t masklo = vld1q_s16(nlm_lane_mask16 + 16 - tail);
+    const int16x8_t maskhi = vld1q_s16(nlm_lane_mask16 + 24 - tail);
+    int32x4_t acc[NLM_PATCH_OFFSETS];
+    for(int q=0;q<NLM_PATCH_OFFSETS;q++) acc[q] = vdupq_n_s32(0);
+
+    for(int n=templeteWindowSize;n--;)
+    {
+        for(int b=0;b<rowBytes;b+=16)
+        {
+            const uint8x16_t tv = vld1q_u8(t+b);
+            for(int q=0;q<NLM_PATCH_OFFSETS;q++)
+            {
+                const uint8x16_t sv = vld1q_u8(s+b+3*q);
+                int16x8_t dlo = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(sv), vget_low_u8(tv)));
+                int16x8_t dhi = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(sv), vget_high_u8(tv)));
+                if(b+16>rowBytes)
+                {
+                    dlo = vandq_s16(dlo, masklo);
+                    dhi = vandq_s16(dhi, maskhi);
+                }
+                acc[q] = nlmSquareAccumulateNEON(nlmSquareAccumulateNEON(acc[q], dlo), dhi);
+            }
+        }
+        t+=step;
+        s+=step;
+        if(n && (cutoff!=INT_MAX))
+        {
+            const int32x4_t partial = vpaddq_s32(vpaddq_s32(acc[0], acc[1]), vpaddq_s32(acc[2], acc[3]));
+            if(!vmaxvq_u32(vcltq_s32(partial, vdupq_n_s32(cutoff))))
+            {
+                vst1q_s32(e, partial);
+                return (1<<NLM_PATCH_OFFSETS)-1;
+            }
+        }
+    }
+    vst1q_s32(e, vpaddq_s32(vpaddq_s32(acc[0], acc[1]), vpaddq_s32(acc[2], acc[3])));
+    return 0;
+}
+
+#endif
+
+// select the kernel for this CPU at runtime (cv::setUseOptimized(false) forces
+// the scalar reference kernel)
+
+template<int TW>
+inline NLMPatchDistanceFn getNLMPatchDistanceKernel3()
+{
+#if NLM_HAVE_AVX2
+    if(cv::useOptimized() && cv::checkHardwareSupport(CV_CPU_AVX2)) return nlmPatchDistance3AVX2<TW>;
+#endif
+#if NLM_HAVE_NEON
+    if(cv::useOptimized() && cv::checkHardwareSupport(CV_CPU_NEON)) return nlmPatchDistance3NEON<TW>;
+#endif
+    return nlmPatchDistance3Scalar<TW>;
+}
+
+/******************************************************************************/
+// compile-time specialised kernels - the direct engine with the template size
+// (TW), search size (SW) and channel count (CN) fixed at compile time, so the
+// template / search loops can be fully unrolled and vectorised by the compiler
+// (colour uses the fixed width instance of the SIMD patch distance kernels).
+// Weight summation order matches the generic loops so the output is identical.
+
+// flags for nonlocalMeansFilter()
+
+enum NLMFlags
+{
+    NLM_DEFAULT = 0,
+    NLM_GENERIC = 1,    // always use the generic (runtime sized) loops
+    NLM_PRUNE = 2,      // stop template distances early once past the weight cutoff
+    NLM_TILED = 4,      // cache blocked tiles + work stealing (see tiled execution below)
+    NLM_FLOAT = 8       // float32 weight pipeline for 8-bit images (see float pipeline below)
+};
+
+// all the direct engine loops are written as span functions - filter output
+// row j for columns [i0,i1) of the bordered image im, returning the number of
+// candidates pruned - that are then scheduled over rows or over tiles
+
+struct NLMSpanParams
+{
+    int templeteWindowSize;
+    int searchWindowSize;
+    const double* w;        // weight table
+    int cutoff;             // template distance cutoff (INT_MAX = no pruning)
+
+    // float pipeline only - weight = exp(-max(distance-woffset,0)*wcoeff), zero
+    // if the exponent is below wlog (= log(minWeight))
+    float wcoeff, woffset, wlog;
+    float fcutoff;          // template distance cutoff (FLT_MAX = no pruning)
+};
+
+typedef int64 (*NLMSpanFn)(const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                           int j, int i0, int i1);
+
+template<int TW, int SW, int CN>
+inline int64 nlmFilterSpecialised(const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                                  int j, int i0, int i1)
+{
+    const int tr = TW>>1;
+    const int sr = SW>>1;
+    const int D = SW*SW;
+    const int H = D/2+1;
+    const int tD = TW*TW;
+    const double tdiv = 1.0/(double)(tD);//templete square div
+    const size_t step = im.step;
+    const double* w = p.w;
+    const int cutoff = p.cutoff;
+    const NLMPatchDistanceFn patchDistance = getNLMPatchDistanceKernel3<TW>();
+    int64 pruned = 0;
+
+    uchar* d = dest.ptr(j) + CN*i0;
+    NLMScratchArena& scratch = nlmScratchArena();
+    int* ww=scratch.get<int>(0,D);
+    double* nw=scratch.get<double>(1,D);
+    for(int i=i0;i<i1;i++)
+    {
+        double tweight=0.0;
+        //search loop
+        const uchar* tprt = im.ptr(sr+j) + CN*(sr+i);
+        const uchar* sptr2 = im.ptr(j) + CN*i;
+        for(int l=SW;l--;)
+        {
+            const uchar* sptr = sptr2 + step*l;
+            int* wwl = ww + l*SW;
+            if((CN==3) && (SW>=NLM_PATCH_OFFSETS))
+            {
+                //templete loop - NLM_PATCH_OFFSETS offsets per pass
+                int e[NLM_PATCH_OFFSETS];
+                for(int k=0;;k+=NLM_PATCH_OFFSETS)
+                {
+                    const int kk = std::min(k, SW-NLM_PATCH_OFFSETS);
+                    const int prunedMask = patchDistance(tprt, sptr+3*kk, step, TW, e, cutoff);
+                    for(int q=0;q<NLM_PATCH_OFFSETS;q++) wwl[kk+q]=e[q]*tdiv;
+                    for(int q=k-kk;q<NLM_PATCH_OFFSETS;q++) pruned += (prunedMask>>q)&1;
+                    if(kk+NLM_PATCH_OFFSETS>=SW) break;
+                }
+            }
+            else
+            {
+                for(int k=0;k<SW;k++)
+                {
+                    //templete loop
+                    int e=0;
+                    const uchar* t = tprt;
+                    const uchar* s = sptr+CN*k;
+                    for(int n=0;n<TW;n++)
+                    {
+                        for(int m=0;m<TW*CN;m++)
+                        {
+                            const int diff = s[m]-t[m];
+                            e += diff*diff;
+                        }
+                        t+=step;
+                        s+=step;
+                        if((e>=cutoff) && (n<TW-1))
+                        {
+                            pruned++;
+                            break;
+                        }
+                    }
+                    wwl[k]=e*tdiv;
+                }
+            }
+            //get weighted Euclidean distance
+            for(int k=SW;k--;) tweight+=w[wwl[k]];
+        }
+        //weight normalization
+        if(tweight==0.0)
+        {
+            for(int z=0;z<D;z++) nw[z]=0;
+            nw[H]=1;
+        }
+        else
+        {
+            double itweight=1.0/(double)tweight;
+            for(int z=0;z<D;z++) nw[z]=w[ww[z]]*itweight;
+        }
+
+        double v[CN];
+        for(int c=0;c<CN;c++) v[c]=0.0;
+        const uchar* s = im.ptr(j+tr) + CN*(tr+i);
+        for(int l=0,count=0;l<SW;l++)
+        {
+            for(int k=0;k<SW;k++,count++)
+            {
+                for(int c=0;c<CN;c++) v[c] += s[CN*k+c]*nw[count];
+            }
+            s+=step;
+        }
+        for(int c=0;c<CN;c++) d[c] = cv::saturate_cast<uchar>(v[c]);
+        d+=CN;
+    }//i
+
+    return pruned;
+}
+
+// the (templateW, searchW) pairs with specialised instances
+
+#define NLM_SPECIALISED_SIZES(X) X(3,7) X(5,11) X(7,21)
+
+// return the specialised kernel for these sizes / channels (or NULL if none)
+
+inline NLMSpanFn getNLMSpecialisedKernel(int templeteWindowSize, int searchWindowSize, int channels)
+{
+#define NLM_SPECIALISED_CASE(TW, SW) \
+    if((templeteWindowSize==TW) && (searchWindowSize==SW)) \
+        return (channels==3) ? nlmFilterSpecialised<TW,SW,3> : nlmFilterSpecialised<TW,SW,1>;
+
+    if((channels==1) || (channels==3))
+    {
+        NLM_SPECIALISED_SIZES(NLM_SPECIALISED_CASE)
+    }
+
+#undef NLM_SPECIALISED_CASE
+
+    return NULL;
+}
+
+/******************************************************************************/
+// generic (runtime sized) span functions of the direct engine
+
+// colour - the template distances use the runtime selected SIMD kernels
+
+inline int64 nlmFilterSpan3(const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                            int j, int i0, int i1)
+{
+    const int templeteWindowSize = p.templeteWindowSize;
+    const int searchWindowSize = p.searchWindowSize;
+    const int tr = templeteWindowSize>>1;
+    const int sr = searchWindowSize>>1;
+    const int D = searchWindowSize*searchWindowSize;
+    const int H=D/2+1;
+    const int tD = templeteWindowSize*templeteWindowSize;
+    const double tdiv = 1.0/(double)(tD);//templete square div
+    const double* w = p.w;
+    const int cutoff = p.cutoff;
+    int64 pruned = 0;
+    const int csstep = im.step-searchWindowSize*3;
+    const NLMPatchDistanceFn patchDistance = getNLMPatchDistanceKernel3<0>();
+
+    uchar* d = dest.ptr(j) + 3*i0;
+    NLMScratchArena& scratch = nlmScratchArena();
+    int* ww=scratch.get<int>(0,D);
+    double* nw=scratch.get<double>(1,D);
+    for(int i=i0;i<i1;i++)
+    {
+        double tweight=0.0;
+        //search loop
+        const uchar* tprt = im.data +im.step*(sr+j) + 3*(sr+i);
+        const uchar* sptr2 = im.data +im.step*j + 3*i;
+        for(int l=searchWindowSize;l--;)
+        {
+            const uchar* sptr = sptr2 +im.step*(l);
+            int* wwl = ww + l*searchWindowSize;
+            int e[NLM_PATCH_OFFSETS];
+
+            //templete loop - NLM_PATCH_OFFSETS offsets per pass (the last
+            //pass is shifted left to overlap the previous one if needed)
+            if(searchWindowSize>=NLM_PATCH_OFFSETS)
+            {
+                for(int k=0;;k+=NLM_PATCH_OFFSETS)
+                {
+                    const int kk = std::min(k, searchWindowSize-NLM_PATCH_OFFSETS);
+                    const int prunedMask = patchDistance(tprt, sptr+3*kk, im.step, templeteWindowSize, e, cutoff);
+                    for(int q=0;q<NLM_PATCH_OFFSETS;q++) wwl[kk+q]=e[q]*tdiv;
+                    for(int q=k-kk;q<NLM_PATCH_OFFSETS;q++) pruned += (prunedMask>>q)&1;
+                    if(kk+NLM_PATCH_OFFSETS>=searchWindowSize) break;
+                }
+            }
+            else
+            {
+                for(int k=0;k<searchWindowSize;k++)
+                {
+                    bool isPruned = false;
+                    wwl[k]=nlmPatchDistance3(tprt, sptr+3*k, im.step, templeteWindowSize, cutoff, &isPruned)*tdiv;
+                    pruned += isPruned;
+                }
+            }
+
+            //get weighted Euclidean distance
+            for(int k=searchWindowSize;k--;) tweight+=w[wwl[k]];
+        }
+        //weight normalization
+        if(tweight==0.0)
+        {
+            for(int z=0;z<D;z++) nw[z]=0;
+            nw[H]=1;
+        }
+        else
+        {
+            double itweight=1.0/(double)tweight;
+            for(int z=0;z<D;z++) nw[z]=w[ww[z]]*itweight;
+        }
+
+        double r=0.0,g=0.0,b=0.0;
+        const uchar* s = im.ptr(j+tr); s+=3*(tr+i);
+        for(int l=searchWindowSize,count=0;l--;)
+        {
+            for(int k=searchWindowSize;k--;)
+            {
+                r += s[0]*nw[count];
+                g += s[1]*nw[count];
+                b += s[2]*nw[count++];
+                s+=3;
+            }
+            s+=csstep;
+        }
+        d[0] = cv::saturate_cast<uchar>(r);
+        d[1] = cv::saturate_cast<uchar>(g);
+        d[2] = cv::saturate_cast<uchar>(b);
+        d+=3;
+    }//i
+
+    return pruned;
+}
+
+// grayscale - the original template loop
+
+inline int64 nlmFilterSpan1(const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                            int j, int i0, int i1)
+{
+    const int templeteWindowSize = p.templeteWindowSize;
+    const int searchWindowSize = p.searchWindowSize;
+    const int tr = templeteWindowSize>>1;
+    const int sr = searchWindowSize>>1;
+    const int D = searchWindowSize*searchWindowSize;
+    const int H=D/2+1;
+    const int tD = templeteWindowSize*templeteWindowSize;
+    const double tdiv = 1.0/(double)(tD);//templete square div
+    const double* w = p.w;
+    const int cutoff = p.cutoff;
+    int64 pruned = 0;
+    const int cstep = im.step-templeteWindowSize;
+    const int csstep = im.step-searchWindowSize;
+
+    uchar* d = dest.ptr(j) + i0;
+    NLMScratchArena& scratch = nlmScratchArena();
+    int* ww=scratch.get<int>(0,D);
+    double* nw=scratch.get<double>(1,D);
+    for(int i=i0;i<i1;i++)
+    {
+        double tweight=0.0;
+        //search loop
+        const uchar* tprt = im.data +im.step*(sr+j) + (sr+i);
+        const uchar* sptr2 = im.data +im.step*j + i;
+        for(int l=searchWindowSize,count=D-1;l--;)
+        {
+            const uchar* sptr = sptr2 +im.step*(l);
+            for (int k=searchWindowSize;k--;)
+            {
+                //templete loop
+                int e=0;
+                const uchar* t = tprt;
+                const uchar* s = sptr+k;
+                for(int n=templeteWindowSize;n--;)
+                {
+                    for(int m=templeteWindowSize;m--;)
+                    {
+                        // computing color L2 norm
+                        e += (*s-*t)*(*s-*t);
+                        s++,t++;
+                    }
+                    t+=cstep;
+                    s+=cstep;
+                    if(n && (e>=cutoff))
+                    {
+                        pruned++;
+                        break;
+                    }
+                }
+                const int ediv = e*tdiv;
+                ww[count--]=ediv;
+                //get weighted Euclidean distance
+                tweight+=w[ediv];
+            }
+        }
+        //weight normalization
+        if(tweight==0.0)
+        {
+            for(int z=0;z<D;z++) nw[z]=0;
+            nw[H]=1;
+        }
+        else
+        {
+            double itweight=1.0/(double)tweight;
+            for(int z=0;z<D;z++) nw[z]=w[ww[z]]*itweight;
+        }
+
+        double v=0.0;
+        const uchar* s = im.ptr(j+tr); s+=(tr+i);
+        for(int l=searchWindowSize,count=0;l--;)
+        {
+            for(int k=searchWindowSize;k--;)
+            {
+                v += *(s++)*nw[count++];
+            }
+            s+=csstep;
+        }
+         *(d++) = cv::saturate_cast<uchar>(v);
+    }//i
+
+    return pruned;
+}
+
+/******************************************************************************/
+// float pipeline (NLM_FLOAT, and always for 16-bit / float images) - span
+// functions templated over the pixel type (8U, 16U, 32F) with float32 distances
+// and accumulation; the distance -> weight mapping is evaluated per candidate
+// with a branch free fast exp (vectorised by the compiler) instead of the
+// 256*256*channels double look up table, which would not fit 16-bit / float
+// data anyway. Distances are not truncated to integers, so for 8-bit images
+// the output matches the table based engines up to rounding. h / sigma are in
+// the units of the pixel values (e.g. 0-65535 for 16-bit images).
+
+// exp(x) for x <= 0 - 2^n (exponent bits) x 2^f (Taylor series, |f| <= 0.5;
+// relative error < 2e-7); underflows to 0 below -87
+
+inline float nlmFastExp(float x)
+{
+    x = std::max(x, -87.0f);
+    const float t = x*1.44269504f;              // x / ln(2)
+    const int n = (int) (t-0.5f);               // round (t <= 0)
+    const float f = (t-n)*0.69314718f;          // in [-ln(2)/2, ln(2)/2]
+    const float p = 1.0f+f*(1.0f+f*(1.0f/2+f*(1.0f/6+f*(1.0f/24+f*(1.0f/120+f*(1.0f/720))))));
+    const int bits = (n+127)<<23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p*scale;
+}
+
+// weight parameters of the float pipeline (see NLMSpanParams)
+
+inline void nlmFloatWeightParams(NLMSpanParams& p, int channels, double h, double sigma,
+                                 double minWeight, bool prune)
+{
+    const double gauss_sd = (sigma == 0.0) ? h :sigma;
+    const int tD = p.templeteWindowSize*p.templeteWindowSize;
+    p.wcoeff = (float) ((1.0/(double)(channels))*(1.0/(h*h)));
+    p.woffset = (float) (2.0*gauss_sd*gauss_sd);
+    p.wlog = (float) std::log(minWeight);
+
+    // template distance (sum over the tD template pixels) beyond which the
+    // weight is certainly zero
+    p.fcutoff = prune ? (float) ((p.woffset-p.wlog/p.wcoeff)*tD*(1.0+1e-6)) : FLT_MAX;
+}
+
+#define NLM_FLOAT_BLOCK 32           // output pixels filtered together
+
+template<typename T, int CN>
+inline int64 nlmFilterSpanFloat(const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                                int j, int i0, int i1)
+{
+    const int templeteWindowSize = p.templeteWindowSize;
+    const int searchWindowSize = p.searchWindowSize;
+    const int tr = templeteWindowSize>>1;
+    const int sr = searchWindowSize>>1;
+    const int D = searchWindowSize*searchWindowSize;
+    const int H = D/2+1;
+    const int B = NLM_FLOAT_BLOCK;
+    const float tdiv = 1.0f/(float)(templeteWindowSize*templeteWindowSize);
+    const float wcoeff = p.wcoeff, woffset = p.woffset, wlog = p.wlog;
+    const float cutoff = p.fcutoff;
+    int64 pruned = 0;
+
+    // per block: distances / weights of offset z for pixel b at [z*B+b], the
+    // per pixel squared differences of one template row and the sums
+
+    NLMScratchArena& scratch = nlmScratchArena();
+    float* dd=scratch.get<float>(0,D*B);
+    float* nw=scratch.get<float>(1,D*B);
+    float* q=scratch.get<float>(2,B+templeteWindowSize);
+    float* v=scratch.get<float>(3,CN*B);
+
+    for(int ib=i0;ib<i1;ib+=B)
+    {
+        const int nb = std::min(B, i1-ib);
+        const int nq = nb+templeteWindowSize-1;
+
+        //search loop - the template distances of one offset are computed for
+        //the whole block (the inner loops over the pixels vectorise)
+        for(int l=0;l<searchWindowSize;l++)
+        {
+            for(int k=0;k<searchWindowSize;k++)
+            {
+                float* e = dd + (l*searchWindowSize+k)*B;
+                for(int b=0;b<nb;b++) e[b]=0.0f;
+                bool isPruned = false;
+                for(int n=0;n<templeteWindowSize;n++)
+                {
+                    //templete loop - squared differences of the row, then
+                    //the templateW wide sum for each pixel
+                    const T* t = im.ptr<T>(sr+j+n) + CN*(sr+ib);
+                    const T* s = im.ptr<T>(j+l+n) + CN*(ib+k);
+                    for(int x=0;x<nq;x++)
+                    {
+                        float sq = 0.0f;
+                        for(int c=0;c<CN;c++)
+                        {
+                            const float diff = (float) s[CN*x+c]-(float) t[CN*x+c];
+                            sq += diff*diff;
+                        }
+                        q[x] = sq;
+                    }
+                    for(int m=0;m<templeteWindowSize;m++)
+                    {
+                        for(int b=0;b<nb;b++) e[b] += q[b+m];
+                    }
+                    //stop once every pixel of the block is past the cutoff
+                    if(n<templeteWindowSize-1)
+                    {
+                        float emin = e[0];
+                        for(int b=1;b<nb;b++) emin = std::min(emin, e[b]);
+                        if(emin>=cutoff)
+                        {
+                            isPruned = true;
+                            break;
+                        }
+                    }
+                }
+                if(isPruned)
+                {
+                    pruned += nb;
+                    for(int b=0;b<nb;b++) e[b]=FLT_MAX;
+                }
+                else
+                {
+                    for(int b=0;b<nb;b++) e[b]*=tdiv;
+                }
+            }
+        }
+
+        //distance -> weight (fast exp, vectorised)
+        for(int z=0;z<D;z++)
+        {
+            const float* e = dd + z*B;
+            float* wz = nw + z*B;
+            for(int b=0;b<nb;b++)
+            {
+                const float x = -std::max(e[b]-woffset,0.0f)*wcoeff;
+                wz[b] = (x>=wlog) ? nlmFastExp(x) : 0.0f;
+            }
+        }
+
+        //weight normalization (v holds the total weights here)
+        for(int b=0;b<nb;b++) v[b]=0.0f;
+        for(int z=0;z<D;z++)
+        {
+            for(int b=0;b<nb;b++) v[b]+=nw[z*B+b];
+        }
+        for(int b=0;b<nb;b++)
+        {
+            if(v[b]==0.0f)
+            {
+                for(int z=0;z<D;z++) nw[z*B+b]=0;
+                nw[H*B+b]=1;
+            }
+            else
+            {
+                const float itweight=1.0f/v[b];
+                for(int z=0;z<D;z++) nw[z*B+b]*=itweight;
+            }
+        }
+
+        for(int x=0;x<CN*nb;x++) v[x]=0.0f;
+        for(int l=0,z=0;l<searchWindowSize;l++)
+        {
+            for(int k=0;k<searchWindowSize;k++,z++)
+            {
+                const T* s = im.ptr<T>(j+tr+l) + CN*(tr+ib+k);
+                const float* wz = nw + z*B;
+                for(int b=0;b<nb;b++)
+                {
+                    for(int c=0;c<CN;c++) v[CN*b+c] += (float) s[CN*b+c]*wz[b];
+                }
+            }
+        }
+        T* d = dest.ptr<T>(j) + CN*ib;
+        for(int x=0;x<CN*nb;x++) d[x] = cv::saturate_cast<T>(v[x]);
+    }
+
+    return pruned;
+}
+
+// return the float pipeline span function for this depth / channels (or NULL)
+
+inline NLMSpanFn getNLMFloatKernel(int depth, int channels)
+{
+    if((channels!=1) && (channels!=3)) return NULL;
+    switch(depth)
+    {
+    case CV_8U:
+        return (channels==3) ? nlmFilterSpanFloat<uchar,3> : nlmFilterSpanFloat<uchar,1>;
+    case CV_16U:
+        return (channels==3) ? nlmFilterSpanFloat<ushort,3> : nlmFilterSpanFloat<ushort,1>;
+    case CV_32F:
+        return (channels==3) ? nlmFilterSpanFloat<float,3> : nlmFilterSpanFloat<float,1>;
+    default:
+        return NULL;
+    }
+}
+
+/******************************************************************************/
+// tiled execution (NLM_TILED) - the output is cut into 2-D tiles sized so that a
+// tile plus its search / template halo of the bordered image stays in a core's
+// cache, and the tiles are run through a work stealing scheduler: each thread
+// owns a contiguous run of tiles (neighbouring tiles share halo rows) and, once
+// its own run is exhausted, takes tiles from the other threads' runs. Per-thread
+// busy time of a tiled run can be returned to the caller (tileStats) for load
+// balance checks.
+
+#define NLM_TILE_CACHE_BYTES (256*1024)  // cache budget for a tile + its halo
+#define NLM_TILES_PER_THREAD 4           // minimum tiles per thread (balance)
+
+struct NLMThreadStats
+{
+    double busy;            // time (ms) spent filtering tiles
+    int tiles;              // number of tiles filtered
+    int stolen;             // number of those taken from another thread's run
+};
+
+// largest square tile whose bordered input, (tile + 2*(sr+tr))^2 pixels, fits
+// the cache budget, reduced until every thread gets a few tiles
+
+inline cv::Size nlmTileSize(const cv::Size& size, int elemSize, int templeteWindowSize,
+                            int searchWindowSize, int nthreads)
+{
+    const int halo = 2*((searchWindowSize>>1)+(templeteWindowSize>>1));
+    int t = (int) std::sqrt((double) NLM_TILE_CACHE_BYTES/elemSize) - halo;
+    t = std::max(16, t&~7);
+    while((t>16) && (((size.width+t-1)/t)*((size.height+t-1)/t)<NLM_TILES_PER_THREAD*nthreads))
+        t = std::max(16, (t/2)&~7);
+    return cv::Size(t,t);
+}
+
+// one thread's run of tiles [next,end) - padded to a cache line as it is
+// updated by its owner and by thieves
+
+struct NLMTileQueue
+{
+    int next;
+    int end;
+    char pad[64-2*sizeof(int)];
+};
+
+// take the next tile of a run (-1 once it is empty)
+
+inline int nlmTakeTile(NLMTileQueue& q)
+{
+    int t;
+#pragma omp atomic capture
+    t = q.next++;
+    return (t<q.end) ? t : -1;
+}
+
+// (tileStats, if given, receives one entry per thread for this run only)
+
+inline int64 nlmRunTiled(NLMSpanFn span, const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                         std::vector<NLMThreadStats>* tileStats=NULL)
+{
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+    const cv::Size tile = nlmTileSize(dest.size(), (int) dest.elemSize(), p.templeteWindowSize,
+                                      p.searchWindowSize, nthreads);
+    const int tilesX = (dest.cols+tile.width-1)/tile.width;
+    const int ntiles = tilesX*((dest.rows+tile.height-1)/tile.height);
+
+    std::vector<NLMTileQueue> queues(nthreads);
+    for(int t=0;t<nthreads;t++)
+    {
+        queues[t].next = (int) ((int64) ntiles*t/nthreads);
+        queues[t].end = (int) ((int64) ntiles*(t+1)/nthreads);
+    }
+    const NLMThreadStats zero = { 0.0, 0, 0 };
+    std::vector<NLMThreadStats> stats(nthreads, zero);
+
+    int64 pruned = 0;
+#pragma omp parallel reduction(+:pruned)
+    {
+        const int tid = nlmThreadNum();
+        NLMThreadStats& st = stats[tid];
+        for(int v=0;v<nthreads;v++)
+        {
+            NLMTileQueue& q = queues[(tid+v)%nthreads];
+            for(int t=nlmTakeTile(q);t>=0;t=nlmTakeTile(q))
+            {
+                const int64 pre = cv::getTickCount();
+                const int x0 = (t%tilesX)*tile.width;
+                const int y0 = (t/tilesX)*tile.height;
+                const int x1 = std::min(x0+tile.width, dest.cols);
+                const int y1 = std::min(y0+tile.height, dest.rows);
+                for(int j=y0;j<y1;j++) pruned += span(im, dest, p, j, x0, x1);
+                st.busy += 1000.0*(cv::getTickCount()-pre)/cv::getTickFrequency();
+                st.tiles++;
+                if(v) st.stolen++;
+            }
+        }
+    }
+    if(tileStats) tileStats->swap(stats);
+    return pruned;
+}
+
+/******************************************************************************/
+// run span function span over all of dest (parallel rows, or tiles if flags
+// contains NLM_TILED) and update the pruning statistics
+
+inline void nlmRunSpans(NLMSpanFn span, const cv::Mat& im, cv::Mat& dest, const NLMSpanParams& p,
+                        int flags, std::vector<NLMThreadStats>* tileStats=NULL)
+{
+    const int64 candidates = (int64) dest.rows*dest.cols*p.searchWindowSize*p.searchWindowSize;
+
+    int64 pruned = 0;
+    if(flags & NLM_TILED)
+    {
+        pruned = nlmRunTiled(span, im, dest, p, tileStats);
+    }
+    else
+    {
+#pragma omp parallel for reduction(+:pruned)
+        for(int j=0;j<dest.rows;j++) pruned += span(im, dest, p, j, 0, dest.cols);
+    }
+
+    // (atomic - filters may run concurrently from different threads)
+    NLMPruneStats& stats = nlmPruneStats();
+#pragma omp atomic
+    stats.candidates += candidates;
+#pragma omp atomic
+    stats.pruned += pruned;
+}
+
+/******************************************************************************/
+// direct engine on an already bordered image - im has a border of sr+tr pixels
+// on every side (and is followed in memory by one spare row for the SIMD
+// kernels), dest receives the (im.rows-2*(sr+tr)) x (im.cols-2*(sr+tr)) output
+// and weight / emax come from createNLMWeightTable()
+
+inline void nonlocalMeansFilterBordered(const cv::Mat& im, cv::Mat& dest, int templeteWindowSize,
+                                        int searchWindowSize, const std::vector<double>& weight,
+                                        int emax, int flags=NLM_DEFAULT,
+                                        std::vector<NLMThreadStats>* tileStats=NULL)
+{
+    const int bb = (searchWindowSize>>1)+(templeteWindowSize>>1);
+    const int tD = templeteWindowSize*templeteWindowSize;
+    const int channels = im.channels();
+
+    dest.create(im.rows-2*bb, im.cols-2*bb, im.type());
+
+    NLMSpanParams p;
+    p.templeteWindowSize = templeteWindowSize;
+    p.searchWindowSize = searchWindowSize;
+    p.w = &weight[0];
+    p.cutoff = (flags & NLM_PRUNE) ? nlmDistanceCutoff(emax, tD) : INT_MAX;
+
+    NLMSpanFn span = getNLMSpecialisedKernel(templeteWindowSize, searchWindowSize, channels);
+    if(!span || !cv::useOptimized() || (flags & NLM_GENERIC))
+        span = (channels==3) ? nlmFilterSpan3 : nlmFilterSpan1;
+
+    nlmRunSpans(span, im, dest, p, flags, tileStats);
+}
+
+// float pipeline on an already bordered image (any depth supported by
+// getNLMFloatKernel(), as above but the weights come from h / sigma directly)
+
+inline void nonlocalMeansFilterBorderedFloat(const cv::Mat& im, cv::Mat& dest, int templeteWindowSize,
+                                             int searchWindowSize, double h, double sigma=0.0,
+                                             int flags=NLM_DEFAULT, double minWeight=NLM_MIN_WEIGHT,
+                                             std::vector<NLMThreadStats>* tileStats=NULL)
+{
+    const int bb = (searchWindowSize>>1)+(templeteWindowSize>>1);
+
+    NLMSpanFn span = getNLMFloatKernel(im.depth(), im.channels());
+    if(!span) return;
+
+    dest.create(im.rows-2*bb, im.cols-2*bb, im.type());
+
+    NLMSpanParams p;
+    p.templeteWindowSize = templeteWindowSize;
+    p.searchWindowSize = searchWindowSize;
+    p.w = NULL;
+    p.cutoff = INT_MAX;
+    nlmFloatWeightParams(p, im.channels(), h, sigma, minWeight, (flags & NLM_PRUNE) != 0);
+
+    nlmRunSpans(span, im, dest, p, flags, tileStats);
+}
+
+/******************************************************************************/
+// main implementaion (direct engine) - O(templateW^2 * searchW^2) per pixel
+// (dispatches to a specialised instance above when one exists, unless flags
+// contains NLM_GENERIC or cv::setUseOptimized(false) is set; NLM_PRUNE enables
+// early termination, minWeight sets the weight cutoff - see pruning above;
+// NLM_TILED selects the tiled execution above instead of parallel rows (tileStats
+// then receives its per-thread statistics); 16-bit and float images, or
+// NLM_FLOAT, use the float pipeline above)
+
+inline void nonlocalMeansFilter(cv::Mat& src, cv::Mat& dest, int templeteWindowSize,
+                                int searchWindowSize, double h, double sigma=0.0,
+                                int flags=NLM_DEFAULT, double minWeight=NLM_MIN_WEIGHT,
+                                std::vector<NLMThreadStats>* tileStats=NULL)
+{
+    if(templeteWindowSize>searchWindowSize)
+    {
+        std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
+        return;
+    }
+    if((src.channels()!=1) && (src.channels()!=3)) return;
+    if(!getNLMFloatKernel(src.depth(), src.channels())) return;
+
+    const int bb = (searchWindowSize>>1)+(templeteWindowSize>>1);
+
+    //create large size image for bounding box (+ a spare row for the SIMD kernels);
+    cv::Mat imBuf(src.rows+2*bb+1,src.cols+2*bb,src.type());
+    cv::Mat im = imBuf.rowRange(0,src.rows+2*bb);
+    cv::copyMakeBorder(src,im,bb,bb,bb,bb,cv::BORDER_DEFAULT);
+
+    if((src.depth()!=CV_8U) || (flags & NLM_FLOAT))
+    {
+        nonlocalMeansFilterBorderedFloat(im, dest, templeteWindowSize, searchWindowSize, h, sigma,
+                                         flags, minWeight, tileStats);
+        return;
+    }
+
+    //weight computation;
+    std::vector<double> weight;
+    const int emax = createNLMWeightTable(weight, src.channels(), h, sigma, minWeight);
+
+    nonlocalMeansFilterBordered(im, dest, templeteWindowSize, searchWindowSize, weight, emax, flags,
+                                tileStats);
+}
+
+/******************************************************************************/
+// streaming (out of core) engine - the image is pulled from a row source in
+// horizontal bands of bandRows output rows; each band is filtered from a window
+// of the source holding only the band and its sr+tr halo rows above and below
+// (the image border is reflected exactly as copyMakeBorder(BORDER_DEFAULT)
+// does, so the output matches nonlocalMeansFilter()) and handed to the row sink
+// as soon as it is done. Memory use is therefore bounded by the band height.
+// Source must provide rows(), cols(), type() and bool read(cv::Mat& rows, int n)
+// (next n rows, in order); Sink must provide write(const cv::Mat& rows).
+// Returns false if the source could not be read.
+
+template<typename Source, typename Sink>
+inline bool nonlocalMeansFilterStream(Source& in, Sink& out, int templeteWindowSize,
+                                      int searchWindowSize, double h, double sigma=0.0,
+                                      int bandRows=256, int flags=NLM_DEFAULT,
+                                      double minWeight=NLM_MIN_WEIGHT)
+{
+    if(templeteWindowSize>searchWindowSize)
+    {
+        std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
+        return false;
+    }
+    const int rows = in.rows();
+    const int cols = in.cols();
+    const int type = in.type();
+    const int cn = CV_MAT_CN(type);
+    if(!getNLMFloatKernel(CV_MAT_DEPTH(type), cn)) return false;
+    const bool useFloat = (CV_MAT_DEPTH(type)!=CV_8U) || (flags & NLM_FLOAT);
+
+    const int bb = (searchWindowSize>>1)+(templeteWindowSize>>1);
+    bandRows = std::max(1, std::min(bandRows, rows));
+
+    std::vector<double> weight;
+    const int emax = useFloat ? 0 : createNLMWeightTable(weight, cn, h, sigma, minWeight);
+
+    // source window holding rows [lo,hi), the bordered band (+ a spare row for
+    // the SIMD kernels) and the filtered band - all allocated once
+
+    cv::Mat window(bandRows+2*bb, cols, type);
+    cv::Mat band(bandRows+2*bb, cols, type);
+    cv::Mat imBuf(bandRows+2*bb+1, cols+2*bb, type);
+    cv::Mat dest, rowsIn;
+    int lo = 0, hi = 0;
+
+    for(int y0=0;y0<rows;y0+=bandRows)
+    {
+        const int y1 = std::min(y0+bandRows, rows);
+        const int needLo = std::max(0, y0-bb);
+        const int needHi = std::min(rows, y1+bb);
+
+        // drop the rows no longer needed, pull the new ones from the source
+
+        if(needLo>lo)
+        {
+            const int keep = std::max(0, hi-needLo);
+            if(keep>0)
+            {
+                window.rowRange(hi-keep-lo, hi-lo).copyTo(rowsIn);   // (may overlap)
+                rowsIn.copyTo(window.rowRange(0, keep));
+            }
+            lo = needLo;
+            hi = std::max(hi, lo);
+        }
+        if(needHi>hi)
+        {
+            cv::Mat newRows = window.rowRange(hi-lo, needHi-lo);
+            if(!in.read(newRows, needHi-hi)) return false;
+            hi = needHi;
+        }
+
+        // bordered band - rows reflected about the image top / bottom, then
+        // the left / right border
+
+        const int n = y1-y0+2*bb;
+        cv::Mat bandRowsM = band.rowRange(0, n);
+        for(int r=0;r<n;r++)
+        {
+            const int y = cv::borderInterpolate(y0-bb+r, rows, cv::BORDER_DEFAULT);
+            window.row(y-lo).copyTo(bandRowsM.row(r));
+        }
+        cv::Mat im = imBuf.rowRange(0, n);
+        cv::copyMakeBorder(bandRowsM, im, 0, 0, bb, bb, cv::BORDER_DEFAULT);
+
+        if(useFloat)
+        {
+            nonlocalMeansFilterBorderedFloat(im, dest, templeteWindowSize, searchWindowSize, h, sigma,
+                                             flags, minWeight);
+        }
+        else
+        {
+            nonlocalMeansFilterBordered(im, dest, templeteWindowSize, searchWindowSize, weight, emax, flags);
+        }
+        out.write(dest);
+    }
+    return true;
+}
+
+/******************************************************************************/
+// cached distance engine - only the weight table depends on h / sigma, so for
+// a still image the template distances (ww, for every pixel and search offset)
+// can be computed once and kept, quantised to 16 bits, and every change of h
+// then only reruns the weight + normalisation pass (interactive tuning). The
+// output matches nonlocalMeansFilter() whenever the weight table's emax is
+// <= 65535 (h up to ~50 for colour, ~90 for grayscale at the default minWeight):
+// larger distances are saturated to 65535, which then already maps to a zero
+// weight. 8-bit images only (1 or 3 channels). Memory is rows x cols x searchW^2
+// x 2 bytes (see maxBytes below).
+
+#define NLM_DISTANCE_CACHE_MAX_BYTES ((size_t) 1<<30)   // default memory limit
+#define NLM_DISTANCE_MAX 65535                          // 16-bit saturation
+
+class NLMDistanceCache
+{
+public:
+    NLMDistanceCache() : templeteWindowSize(0), searchWindowSize(0) {}
+
+    // true if the cache holds the distances of src for these window sizes
+
+    bool matches(const cv::Mat& src, int templeteWindowSize_, int searchWindowSize_) const
+    {
+        if(dist.empty() || (templeteWindowSize_!=templeteWindowSize)
+           || (searchWindowSize_!=searchWindowSize)
+           || (src.size()!=srcSize) || (src.type()!=im.type()))
+            return false;
+
+        // same pixels (O(N) compare - cheap next to the O(N x D) distances)
+        const int bb = (searchWindowSize>>1)+(templeteWindowSize>>1);
+        const size_t rowBytes = src.cols*src.elemSize();
+        for(int j=0;j<src.rows;j++)
+        {
+            if(memcmp(src.ptr(j), im.ptr(j+bb)+bb*src.elemSize(), rowBytes)) return false;
+        }
+        return true;
+    }
+
+    // compute and cache the template distances of src - returns false (and
+    // leaves the cache empty) if they would need more than maxBytes
+
+    bool compute(const cv::Mat& src, int templeteWindowSize_, int searchWindowSize_,
+                 size_t maxBytes=NLM_DISTANCE_CACHE_MAX_BYTES)
+    {
+        clear();
+        if(templeteWindowSize_>searchWindowSize_)
+        {
+            std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
+            return false;
+        }
+        const int cn = src.channels();
+        if((cn!=1) && (cn!=3)) return false;
+        if(src.depth()!=CV_8U) return false;
+
+        const int D = searchWindowSize_*searchWindowSize_;
+        const size_t n = (size_t) src.rows*src.cols*D;
+        if(n*sizeof(ushort)>maxBytes) return false;
+
+        templeteWindowSize = templeteWindowSize_;
+        searchWindowSize = searchWindowSize_;
+        srcSize = src.size();
+
+        const int tr = templeteWindowSize>>1;
+        const int sr = searchWindowSize>>1;
+        const int bb = sr+tr;
+        const int tD = templeteWindowSize*templeteWindowSize;
+        const double tdiv = 1.0/(double)(tD);//templete square div
+
+        //create large size image for bounding box (+ a spare row for the SIMD kernels);
+        imBuf.create(src.rows+2*bb+1, src.cols+2*bb, src.type());
+        im = imBuf.rowRange(0, src.rows+2*bb);
+        cv::copyMakeBorder(src,im,bb,bb,bb,bb,cv::BORDER_DEFAULT);
+
+        dist.resize(n);
+        const size_t step = im.step;
+        const NLMPatchDistanceFn patchDistance = getNLMPatchDistanceKernel3<0>();
+        const bool grouped = (cn==3) && (searchWindowSize>=NLM_PATCH_OFFSETS);
+
+#pragma omp parallel for
+        for(int j=0;j<src.rows;j++)
+        {
+            ushort* q = &dist[(size_t) j*src.cols*D];
+            for(int i=0;i<src.cols;i++,q+=D)
+            {
+                const uchar* tprt = im.ptr(sr+j) + cn*(sr+i);
+                for(int l=0;l<searchWindowSize;l++)
+                {
+                    const uchar* sptr = im.ptr(j+l) + cn*i;
+                    ushort* ql = q + l*searchWindowSize;
+                    int e[NLM_PATCH_OFFSETS];
+                    for(int k=0;k<searchWindowSize;)
+                    {
+                        // template distances for the next one (or group of) offset(s)
+                        int kk = k, m = 1;
+                        if(grouped)
+                        {
+                            kk = std::min(k, searchWindowSize-NLM_PATCH_OFFSETS);
+                            m = NLM_PATCH_OFFSETS;
+                            patchDistance(tprt, sptr+3*kk, step, templeteWindowSize, e, INT_MAX);
+                        }
+                        else
+                        {
+                            e[0]=0;
+                            const uchar* t = tprt;
+                            const uchar* s = sptr+cn*k;
+                            for(int y=0;y<templeteWindowSize;y++)
+                            {
+                                for(int x=0;x<templeteWindowSize*cn;x++)
+                                {
+                                    const int diff = s[x]-t[x];
+                                    e[0] += diff*diff;
+                                }
+                                t+=step;
+                                s+=step;
+                            }
+                        }
+                        for(int r=0;r<m;r++)
+                        {
+                            const int ediv = e[r]*tdiv;
+                            ql[kk+r] = (ushort) std::min(ediv, NLM_DISTANCE_MAX);
+                        }
+                        k = kk+m;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // filter the cached image with strength h / sigma (weight + normalisation
+    // pass only - same arithmetic as the direct engine)
+
+    void filter(cv::Mat& dest, double h, double sigma=0.0, double minWeight=NLM_MIN_WEIGHT)
+    {
+        if(dist.empty()) return;
+
+        const int cn = im.channels();
+        const int tr = templeteWindowSize>>1;
+        const int D = searchWindowSize*searchWindowSize;
+        const int H = D/2+1;
+        const size_t step = im.step;
+
+        createNLMWeightTable(weight, cn, h, sigma, minWeight);
+        const double* w = &weight[0];
+
+        dest.create(srcSize, im.type());
+
+#pragma omp parallel for
+        for(int j=0;j<dest.rows;j++)
+        {
+            double* nw = nlmScratchArena().get<double>(1,D);
+            const ushort* q = &dist[(size_t) j*dest.cols*D];
+            uchar* d = dest.ptr(j);
+            for(int i=0;i<dest.cols;i++,q+=D,d+=cn)
+            {
+                double tweight=0.0;
+                for(int z=D;z--;) tweight+=w[q[z]];
+
+                //weight normalization
+                if(tweight==0.0)
+                {
+                    for(int z=0;z<D;z++) nw[z]=0;
+                    nw[H]=1;
+                }
+                else
+                {
+                    double itweight=1.0/(double)tweight;
+                    for(int z=0;z<D;z++) nw[z]=w[q[z]]*itweight;
+                }
+
+                double v[3] = { 0.0, 0.0, 0.0 };
+                const uchar* s = im.ptr(j+tr) + cn*(tr+i);
+                for(int l=0,count=0;l<searchWindowSize;l++)
+                {
+                    for(int k=0;k<searchWindowSize;k++,count++)
+                    {
+                        for(int c=0;c<cn;c++) v[c] += s[cn*k+c]*nw[count];
+                    }
+                    s+=step;
+                }
+                for(int c=0;c<cn;c++) d[c] = cv::saturate_cast<uchar>(v[c]);
+            }
+        }
+    }
+
+    // release the cached distances
+
+    void clear()
+    {
+        dist.clear();
+        std::vector<ushort>().swap(dist);
+        templeteWindowSize = searchWindowSize = 0;
+    }
+
+    // memory held by the cached distances (bytes)
+
+    size_t bytes() const { return dist.size()*sizeof(ushort); }
+
+private:
+    std::vector<ushort> dist;       // per pixel (row major) searchW^2 distances
+    cv::Mat imBuf, im;              // bordered image (+ spare row)
+    cv::Size srcSize;               // size of the cached image
+    int templeteWindowSize;
+    int searchWindowSize;
+    std::vector<double> weight;     // weight look up table
+};
+
+/******************************************************************************/
+// integral image engine - for each search offset we build an integral image of
+// the per-pixel squared differences (over all channels) so that every template
+// distance becomes an O(1) box lookup, giving O(searchW^2) per pixel independent
+// of the template size. Uses the same weight table / distance quantisation as
+// nonlocalMeansFilter() above so the output matches it (up to the rounding of
+// the floating point weighted sums).
+
+#define NLM_INTEGRAL_BAND_ROWS 32   // output rows processed per band (per thread)
+
+inline void nonlocalMeansFilterIntegral(cv::Mat& src, cv::Mat& dest, int templeteWindowSize,
+                                        int searchWindowSize, double h, double sigma=0.0)
+{
+    if(templeteWindowSize>searchWindowSize)
+    {
+        std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
+        return;
+    }
+    if((src.channels()!=1) && (src.channels()!=3)) return;
+    dest.create(src.size(), src.type());
+
+    const int cn = src.channels();
+    const int tr = templeteWindowSize>>1;
+    const int sr = searchWindowSize>>1;
+    const int bb = sr+tr;
+    const int D = searchWindowSize*searchWindowSize;
+    const int H=D/2+1;
+    const int tD = templeteWindowSize*templeteWindowSize;
+    const double tdiv = 1.0/(double)(tD);//templete square div
+
+    // offset used for the output when all weights are zero (as direct engine)
+
+    const int lH = H / searchWindowSize;
+    const int kH = H % searchWindowSize;
+
+    //create large size image for bounding box;
+    cv::Mat im;
+    cv::copyMakeBorder(src,im,bb,bb,bb,bb,cv::BORDER_DEFAULT);
+
+    //weight computation;
+    std::vector<double> weight;
+    createNLMWeightTable(weight, cn, h, sigma);
+    const double* w = &weight[0];
+
+    // integral image covers the template footprint of every pixel in a band
+
+    const int iw = src.cols + templeteWindowSize;
+    const int nbands = (src.rows + NLM_INTEGRAL_BAND_ROWS - 1) / NLM_INTEGRAL_BAND_ROWS;
+
+
+#pragma omp parallel for schedule(dynamic)
+    for(int band=0;band<nbands;band++)
+    {
+        const int j0 = band * NLM_INTEGRAL_BAND_ROWS;
+        const int bh = std::min(NLM_INTEGRAL_BAND_ROWS, src.rows - j0);
+        const int ih = bh + templeteWindowSize;
+
+        NLMScratchArena& scratch = nlmScratchArena();
+        int64* integ = scratch.get<int64>(0, ih * iw);
+        double* tweight = scratch.get<double>(1, bh * src.cols);
+        double* acc = scratch.get<double>(2, bh * src.cols * cn);
+        memset(integ, 0, iw * sizeof(int64));       // row 0 stays at zero
+        memset(tweight, 0, bh * src.cols * sizeof(double));
+        memset(acc, 0, bh * src.cols * cn * sizeof(double));
+
+        for(int l=0;l<searchWindowSize;l++)
+        {
+            for(int k=0;k<searchWindowSize;k++)
+            {
+                // integral of the squared differences between the template
+                // at offset (l,k) and the reference template (at offset (sr,sr))
+
+                for(int y=0;y<ih-1;y++)
+                {
+                    const uchar* s = im.ptr(j0+l+y) + cn*k;
+                    const uchar* t = im.ptr(j0+sr+y) + cn*sr;
+                    const int64* ip = &integ[y*iw];
+                    int64* ic = &integ[(y+1)*iw];
+                    int64 rowsum = 0;
+                    ic[0] = 0;
+                    for(int x=0;x<iw-1;x++)
+                    {
+                        int e = 0;
+                        for(int c=0;c<cn;c++)
+                        {
+                            const int d = s[c]-t[c];
+                            e += d*d;
+                        }
+                        s+=cn,t+=cn;
+                        rowsum += e;
+                        ic[x+1] = ip[x+1] + rowsum;
+                    }
+                }
+
+                // O(1) template distance lookup + weighted accumulation
+
+                for(int y=0;y<bh;y++)
+                {
+                    const int64* i0 = &integ[y*iw];
+                    const int64* i1 = &integ[(y+templeteWindowSize)*iw];
+                    const uchar* p = im.ptr(j0+y+l+tr) + cn*(k+tr);
+                    double* tw = &tweight[y*src.cols];
+                    double* a = &acc[y*src.cols*cn];
+                    for(int x=0;x<src.cols;x++)
+                    {
+                        const int e = (int) (i1[x+templeteWindowSize] - i1[x]
+                                             - i0[x+templeteWindowSize] + i0[x]);
+                        const int ediv = e*tdiv;
+                        const double wv = w[ediv];
+                        tw[x] += wv;
+                        for(int c=0;c<cn;c++) a[c] += wv*p[c];
+                        a+=cn,p+=cn;
+                    }
+                }
+            }
+        }
+
+        //weight normalization + output
+
+        for(int y=0;y<bh;y++)
+        {
+            uchar* d = dest.ptr(j0+y);
+            const uchar* p = im.ptr(j0+y+lH+tr) + cn*(kH+tr);
+            const double* tw = &tweight[y*src.cols];
+            const double* a = &acc[y*src.cols*cn];
+            for(int x=0;x<src.cols;x++)
+            {
+                if(tw[x]==0.0)
+                {
+                    for(int c=0;c<cn;c++) d[c] = p[c];
+                }
+                else
+                {
+                    const double itweight=1.0/tw[x];
+                    for(int c=0;c<cn;c++) d[c] = cv::saturate_cast<uchar>(a[c]*itweight);
+                }
+                d+=cn,p+=cn,a+=cn;
+            }
+        }
+    }
+}
+
+/******************************************************************************/
+// patch aggregation engine ("BM3D-lite") - the direct engine runs a full search
+// for every output pixel but keeps only the estimate of the template centre.
+// Here the search is run only for reference patches on a grid of the given
+// stride, and each reference patch contributes the weighted average of its
+// matched patches to every pixel it covers; each output pixel is then the mean
+// of the (templateW^2 / stride^2 on average) estimates it received. A stride of
+// s cuts the number of searches by s^2 - strides up to about templateW / 2 keep
+// the PSNR within ~0.3 dB of the direct engine (the stride is limited to
+// templateW, so every pixel is covered). Uses the same weight table / template
+// distances as the direct engine (8-bit images, NLM_PRUNE supported).
+
+// Reference:
+// A. Buades, B. Coll, J.M. Morel "Non-Local Means Denoising"
+// Image Processing On Line, Vol 1, pp: 208-212, 2011 (patch-wise NL-means).
+// K. Dabov, A. Foi, V. Katkovnik, K. Egiazarian "Image Denoising by Sparse 3-D
+// Transform-Domain Collaborative Filtering" (the aggregation step of BM3D)
+// IEEE Transactions on Image Processing, Vol 16(8), pp: 2080-2095, 2007.
+
+#define NLM_AGGREGATE_STRIDE 2          // default reference patch stride
+#define NLM_AGGREGATE_CHUNK_ROWS 16     // output rows per parallel chunk (at least)
+
+// reference positions 0, stride, 2*stride ... (+ the last position, n-1)
+
+inline void nlmAggregateGrid(std::vector<int>& grid, int n, int stride)
+{
+    grid.clear();
+    for(int x=0;x<n;x+=stride) grid.push_back(x);
+    if(grid.back()!=n-1) grid.push_back(n-1);
+}
+
+// normalised search weights nw (row major over the search window) of the
+// reference patch at output pixel (j,i) of the bordered image im - the search
+// loop of the direct engine span functions; returns the candidates pruned
+
+inline int64 nlmSearchWeights(const cv::Mat& im, const NLMSpanParams& p, int j, int i,
+                              int* ww, double* nw)
+{
+    const int templeteWindowSize = p.templeteWindowSize;
+    const int searchWindowSize = p.searchWindowSize;
+    const int sr = searchWindowSize>>1;
+    const int cn = im.channels();
+    const int D = searchWindowSize*searchWindowSize;
+    const int H=D/2+1;
+    const double tdiv = 1.0/(double)(templeteWindowSize*templeteWindowSize);//templete square div
+    const double* w = p.w;
+    const int cutoff = p.cutoff;
+    int64 pruned = 0;
+
+    const uchar* tprt = im.ptr(sr+j) + cn*(sr+i);
+    for(int l=0;l<searchWindowSize;l++)
+    {
+        const uchar* sptr = im.ptr(j+l) + cn*i;
+        int* wwl = ww + l*searchWindowSize;
+        if((cn==3) && (searchWindowSize>=NLM_PATCH_OFFSETS))
+        {
+            const NLMPatchDistanceFn patchDistance = getNLMPatchDistanceKernel3<0>();
+            int e[NLM_PATCH_OFFSETS];
+            for(int k=0;;k+=NLM_PATCH_OFFSETS)
+            {
+                const int kk = std::min(k, searchWindowSize-NLM_PATCH_OFFSETS);
+                const int prunedMask = patchDistance(tprt, sptr+3*kk, im.step, templeteWindowSize, e, cutoff);
+                for(int q=0;q<NLM_PATCH_OFFSETS;q++) wwl[kk+q]=e[q]*tdiv;
+                for(int q=k-kk;q<NLM_PATCH_OFFSETS;q++) pruned += (prunedMask>>q)&1;
+                if(kk+NLM_PATCH_OFFSETS>=searchWindowSize) break;
+            }
+        }
+        else if(cn==3)
+        {
+            for(int k=0;k<searchWindowSize;k++)
+            {
+                bool isPruned = false;
+                wwl[k]=nlmPatchDistance3(tprt, sptr+3*k, im.step, templeteWindowSize, cutoff, &isPruned)*tdiv;
+                pruned += isPruned;
+            }
+        }
+        else
+        {
+            for(int k=0;k<searchWindowSize;k++)
+            {
+                int e=0;
+                const uchar* t = tprt;
+                const uchar* s = sptr+k;
+                for(int n=templeteWindowSize;n--;)
+                {
+                    for(int m=0;m<templeteWindowSize;m++) e += (s[m]-t[m])*(s[m]-t[m]);
+                    t+=im.step;
+                    s+=im.step;
+                    if(n && (e>=cutoff))
+                    {
+                        pruned++;
+                        break;
+                    }
+                }
+                wwl[k]=e*tdiv;
+            }
+        }
+    }
+
+    double tweight=0.0;
+    for(int z=0;z<D;z++) tweight+=w[ww[z]];
+
+    //weight normalization
+    if(tweight==0.0)
+    {
+        for(int z=0;z<D;z++) nw[z]=0;
+        nw[H]=1;
+    }
+    else
+    {
+        double itweight=1.0/(double)tweight;
+        for(int z=0;z<D;z++) nw[z]=w[ww[z]]*itweight;
+    }
+    return pruned;
+}
+
+inline void nonlocalMeansFilterAggregate(cv::Mat& src, cv::Mat& dest, int templeteWindowSize,
+                                         int searchWindowSize, double h, double sigma=0.0,
+                                         int stride=NLM_AGGREGATE_STRIDE, int flags=NLM_DEFAULT,
+                                         double minWeight=NLM_MIN_WEIGHT)
+{
+    if(templeteWindowSize>searchWindowSize)
+    {
+        std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
+        return;
+    }
+    if(((src.channels()!=1) && (src.channels()!=3)) || (src.depth()!=CV_8U)) return;
+
+    const int cn = src.channels();
+    const int tr = templeteWindowSize>>1;
+    const int sr = searchWindowSize>>1;
+    const int bb = sr+tr;
+    const int D = searchWindowSize*searchWindowSize;
+    const int tD = templeteWindowSize*templeteWindowSize;
+    stride = std::max(1, std::min(stride, templeteWindowSize));
+
+    //create large size image for bounding box (+ a spare row for the SIMD kernels);
+    cv::Mat imBuf(src.rows+2*bb+1,src.cols+2*bb,src.type());
+    cv::Mat im = imBuf.rowRange(0,src.rows+2*bb);
+    cv::copyMakeBorder(src,im,bb,bb,bb,bb,cv::BORDER_DEFAULT);
+    const size_t step = im.step;
+
+    //weight computation;
+    std::vector<double> weight;
+    const int emax = createNLMWeightTable(weight, cn, h, sigma, minWeight);
+
+    NLMSpanParams p;
+    p.templeteWindowSize = templeteWindowSize;
+    p.searchWindowSize = searchWindowSize;
+    p.w = &weight[0];
+    p.cutoff = (flags & NLM_PRUNE) ? nlmDistanceCutoff(emax, tD) : INT_MAX;
+
+    std::vector<int> gy, gx;
+    nlmAggregateGrid(gy, src.rows, stride);
+    nlmAggregateGrid(gx, src.cols, stride);
+
+    // per pixel sum of the estimates (acc) and their number (count)
+
+    std::vector<double> acc((size_t) src.rows*src.cols*cn, 0.0);
+    std::vector<int> count((size_t) src.rows*src.cols, 0);
+
+    // reference rows are taken in chunks spanning > 2*tr rows, so chunks two
+    // apart never write to the same pixels - all the even chunks run in
+    // parallel, then all the odd ones (no locking of the accumulators)
+
+    const int chunk = std::max((2*tr+stride-1)/stride, std::max(1, NLM_AGGREGATE_CHUNK_ROWS/stride));
+    const int nchunks = ((int) gy.size()+chunk-1)/chunk;
+    int64 pruned = 0;
+
+    for(int phase=0;phase<2;phase++)
+    {
+#pragma omp parallel for schedule(dynamic) reduction(+:pruned)
+        for(int c=phase;c<nchunks;c+=2)
+        {
+            NLMScratchArena& scratch = nlmScratchArena();
+            int* ww = scratch.get<int>(0,D);
+            double* nw = scratch.get<double>(1,D);
+            double* est = scratch.get<double>(2,tD*cn);
+            int* off = scratch.get<int>(3,D);
+
+            const int g1 = std::min((c+1)*chunk, (int) gy.size());
+            for(int g=c*chunk;g<g1;g++)
+            {
+                const int j = gy[g];
+                for(size_t f=0;f<gx.size();f++)
+                {
+                    const int i = gx[f];
+                    pruned += nlmSearchWeights(im, p, j, i, ww, nw);
+
+                    // matched patches only (zero weights skipped)
+                    int n = 0;
+                    for(int z=0;z<D;z++)
+                    {
+                        if(nw[z]==0.0) continue;
+                        off[n] = (z/searchWindowSize)*step + cn*(z%searchWindowSize);
+                        nw[n++] = nw[z];
+                    }
+
+                    // estimate of the whole reference patch - weighted average
+                    // of the matched patches (the candidate at search offset
+                    // (l,k) has its top left corner at im(j+l, i+k))
+                    for(int z=0;z<tD*cn;z++) est[z]=0.0;
+                    const uchar* base = im.ptr(j) + cn*i;
+                    for(int z=0;z<n;z++)
+                    {
+                        const uchar* s = base + off[z];
+                        const double wz = nw[z];
+                        double* e = est;
+                        for(int u=0;u<templeteWindowSize;u++,s+=step,e+=templeteWindowSize*cn)
+                        {
+                            for(int v=0;v<templeteWindowSize*cn;v++) e[v] += wz*s[v];
+                        }
+                    }
+
+                    // aggregate the estimate over the pixels it covers
+                    for(int u=0;u<templeteWindowSize;u++)
+                    {
+                        const int y = j-tr+u;
+                        if((y<0) || (y>=src.rows)) continue;
+                        for(int v=0;v<templeteWindowSize;v++)
+                        {
+                            const int x = i-tr+v;
+                            if((x<0) || (x>=src.cols)) continue;
+                            const double* e = est + (u*templeteWindowSize+v)*cn;
+                            double* a = &acc[((size_t) y*src.cols+x)*cn];
+                            for(int ch=0;ch<cn;ch++) a[ch] += e[ch];
+                            count[(size_t) y*src.cols+x]++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    dest.create(src.size(), src.type());
+
+#pragma omp parallel for
+    for(int y=0;y<src.rows;y++)
+    {
+        uchar* d = dest.ptr(y);
+        const double* a = &acc[(size_t) y*src.cols*cn];
+        const int* n = &count[(size_t) y*src.cols];
+        for(int x=0;x<src.cols;x++,d+=cn,a+=cn)
+        {
+            const double in = 1.0/n[x];
+            for(int ch=0;ch<cn;ch++) d[ch] = cv::saturate_cast<uchar>(a[ch]*in);
+        }
+    }
+
+    // (atomic - filters may run concurrently from different threads)
+    const int64 candidates = (int64) gy.size()*gx.size()*D;
+    NLMPruneStats& stats = nlmPruneStats();
+#pragma omp atomic
+    stats.candidates += candidates;
+#pragma omp atomic
+    stats.pruned += pruned;
+}
+
+/******************************************************************************/
+// spatio-temporal NLM for video - patches for each pixel of the current frame
+// are searched for across a ring buffer of the last K frames (same spatial
+// search window in each), exploiting the redundancy between frames so a much
+// smaller spatial search window can be used. The ring holds the bordered frames
+// and its slots are allocated once and overwritten in place frame to frame.
+
+#define NLM_TEMPORAL_MAX_FRAMES 8   // upper limit of K (for user interfaces)
+
+class TemporalNLMFilter
+{
+public:
+    TemporalNLMFilter() : ringType(-1), head(-1), count(0) {}
+
+    // forget all previous frames (slots are kept for reuse)
+
+    void reset() { head = -1; count = 0; }
+
+    // number of frames currently held in the ring buffer
+
+    int size() const { return count; }
+
+    // add frame src to the ring buffer of (up to) frames frames and denoise it
+    // using the patches of all frames held
+
+    void filter(const cv::Mat& src, cv::Mat& dest, int frames, int templeteWindowSize,
+                int searchWindowSize, double h, double sigma=0.0)
+    {
+        if(templeteWindowSize>searchWindowSize)
+        {
+            std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
+            return;
+        }
+        if((src.channels()!=1) && (src.channels()!=3)) return;
+        frames = std::max(1, frames);
+
+        const int cn = src.channels();
+        const int tr = templeteWindowSize>>1;
+        const int sr = searchWindowSize>>1;
+        const int bb = sr+tr;
+        const int tD = templeteWindowSize*templeteWindowSize;
+        const double tdiv = 1.0/(double)(tD);//templete square div
+
+        // (re)allocate the ring only if its geometry changes (+ a spare row
+        // for the SIMD patch distance kernels)
+
+        const cv::Size slotSize(src.cols+2*bb, src.rows+2*bb+1);
+        if(((int) ring.size()!=frames) || (ringSize!=slotSize) || (ringType!=src.type()))
+        {
+            ring.resize(frames);
+            for(int f=0;f<frames;f++) ring[f].create(slotSize, src.type());
+            ringSize = slotSize;
+            ringType = src.type();
+            reset();
+        }
+
+        // bordered copy of the new frame overwrites the oldest slot
+
+        head = (head+1) % frames;
+        count = std::min(count+1, frames);
+        cv::Mat im = ring[head].rowRange(0, src.rows+2*bb);
+        cv::copyMakeBorder(src,im,bb,bb,bb,bb,cv::BORDER_DEFAULT);
+
+        dest.create(src.size(), src.type());
+
+        //weight computation;
+        createNLMWeightTable(weight, cn, h, sigma);
+        const double* w = &weight[0];
+
+        // slots newest (current frame) first
+
+        std::vector<const uchar*> slots(count);
+        for(int f=0;f<count;f++) slots[f] = ring[(head-f+frames) % frames].ptr(0);
+        const size_t step = im.step;
+        const NLMPatchDistanceFn patchDistance = getNLMPatchDistanceKernel3<0>();
+        const bool grouped = (cn==3) && (searchWindowSize>=NLM_PATCH_OFFSETS);
+
+#pragma omp parallel for
+        for(int j=0;j<src.rows;j++)
+        {
+            uchar* d = dest.ptr(j);
+            for(int i=0;i<src.cols;i++)
+            {
+                double tweight=0.0;
+                double v[3] = { 0.0, 0.0, 0.0 };
+                const uchar* tprt = slots[0] + step*(sr+j) + cn*(sr+i);
+
+                //search loop (over frames then the spatial window)
+                for(int f=0;f<count;f++)
+                {
+                    const uchar* sptr2 = slots[f] + step*j + cn*i;
+                    for(int l=0;l<searchWindowSize;l++)
+                    {
+                        const uchar* sptr = sptr2 + step*l;
+                        int e[NLM_PATCH_OFFSETS];
+                        for(int k=0;k<searchWindowSize;)
+                        {
+                            // template distances for the next one (or group of) offset(s)
+                            int kk = k, n = 1;
+                            if(grouped)
+                            {
+                                kk = std::min(k, searchWindowSize-NLM_PATCH_OFFSETS);
+                                n = NLM_PATCH_OFFSETS;
+                                patchDistance(tprt, sptr+3*kk, step, templeteWindowSize, e, INT_MAX);
+                            }
+                            else
+                            {
+                                e[0]=0;
+                                const uchar* t = tprt;
+                                const uchar* s = sptr+cn*k;
+                                for(int y=0;y<templeteWindowSize;y++)
+                                {
+                                    for(int x=0;x<templeteWindowSize*cn;x++)
+                                    {
+                                        const int diff = s[x]-t[x];
+                                        e[0] += diff*diff;
+                                    }
+                                    t+=step;
+                                    s+=step;
+                                }
+                            }
+
+                            // weighted accumulation (skipping offsets already
+                            // covered when the last group overlaps the previous)
+                            for(int q=k-kk;q<n;q++)
+                            {
+                                const int ediv = e[q]*tdiv;
+                                const double wv = w[ediv];
+                                const uchar* p = sptr + step*tr + cn*(kk+q+tr);
+                                tweight += wv;
+                                for(int c=0;c<cn;c++) v[c] += wv*p[c];
+                            }
+                            k = kk+n;
+                        }
+                    }
+                }
+
+                //weight normalization (current pixel if all weights are zero)
+                if(tweight==0.0)
+                {
+                    const uchar* p = tprt + step*tr + cn*tr;
+                    for(int c=0;c<cn;c++) d[c] = p[c];
+                }
+                else
+                {
+                    const double itweight=1.0/tweight;
+                    for(int c=0;c<cn;c++) d[c] = cv::saturate_cast<uchar>(v[c]*itweight);
+                }
+                d+=cn;
+            }//i
+        }//j
+    }
+
+private:
+    std::vector<cv::Mat> ring;      // bordered frames
+    cv::Size ringSize;              // size of each ring slot
+    int ringType;                   // type of each ring slot
+    int head;                       // slot of the newest frame
+    int count;                      // number of frames held
+    std::vector<double> weight;     // weight look up table
+};
+
+/******************************************************************************/
+// multi-resolution (pyramid) preview for live video - NLM is run on the frame
+// reduced L times by cv::pyrDown() (search window and h reduced in proportion,
+// as the noise is too), and the result is brought back to full resolution by
+// a fast guided filter: the linear coefficients relating the reduced noisy
+// frame to its denoised version are fitted at the low resolution, upsampled,
+// and applied to the full resolution frame - so edges follow the full
+// resolution frame while flat areas take the denoised values. See:
+
+// K. He, J. Sun, X. Tang, "Guided Image Filtering", IEEE Transactions on
+// Pattern Analysis and Machine Intelligence, 35(6), pp: 1397-1409, 2013.
+// K. He, J. Sun, "Fast Guided Filter", arXiv:1505.00996, 2015.
+
+// Given a frame budget (ms) the level is chosen automatically from the timing
+// of the previous frames (level 0 = plain nonlocalMeansFilter()).
+
+#define NLM_PYRAMID_MAX_LEVELS 3    // deepest pyramid level used
+#define NLM_PYRAMID_GUIDE_RADIUS 1  // guided filter box radius (low resolution pixels)
+
+// search window used at pyramid level (odd, >= template window)
+
+inline int nlmPyramidSearchWindow(int templeteWindowSize, int searchWindowSize, int level)
+{
+    return std::max(templeteWindowSize, (searchWindowSize>>level)|1);
+}
+
+// filter src at the given pyramid level (returns the level actually used -
+// reduced if the image is too small for it)
+
+inline int nonlocalMeansFilterPyramid(cv::Mat& src, cv::Mat& dest, int level, int templeteWindowSize,
+                                      int searchWindowSize, double h, double sigma=0.0,
+                                      int flags=NLM_DEFAULT)
+{
+    level = std::max(0, std::min(level, NLM_PYRAMID_MAX_LEVELS));
+    while((level>0) && (std::min(src.rows, src.cols)>>level) < 2*searchWindowSize) level--;
+
+    if(level==0)
+    {
+        nonlocalMeansFilter(src, dest, templeteWindowSize, searchWindowSize, h, sigma, flags);
+        return 0;
+    }
+
+    // reduced frame and NLM at that resolution
+
+    cv::Mat down = src;
+    for(int l=0;l<level;l++) cv::pyrDown(down, down);
+    cv::Mat small;
+    const double scale = 1.0/(1<<level);
+    nonlocalMeansFilter(down, small, templeteWindowSize,
+                        nlmPyramidSearchWindow(templeteWindowSize, searchWindowSize, level),
+                        h*scale, sigma*scale, flags);
+
+    // fast guided filter - a, b fitted at low resolution (guide = reduced
+    // noisy frame, input = its denoised version, eps = noise variance of the
+    // full resolution frame), upsampled and applied to src
+
+    const cv::Size box(2*NLM_PYRAMID_GUIDE_RADIUS+1, 2*NLM_PYRAMID_GUIDE_RADIUS+1);
+    const double eps = h*h;
+    cv::Mat I, P, meanI, meanP, corrIP, corrII;
+    down.convertTo(I, CV_32F);
+    small.convertTo(P, CV_32F);
+    cv::boxFilter(I, meanI, -1, box);
+    cv::boxFilter(P, meanP, -1, box);
+    cv::boxFilter(I.mul(P), corrIP, -1, box);
+    cv::boxFilter(I.mul(I), corrII, -1, box);
+
+    cv::Mat covIP = corrIP - meanI.mul(meanP);
+    cv::Mat varI = corrII - meanI.mul(meanI) + cv::Scalar::all(eps);
+    cv::Mat a, b;
+    cv::divide(covIP, varI, a);
+    b = meanP - a.mul(meanI);
+    cv::boxFilter(a, a, -1, box);
+    cv::boxFilter(b, b, -1, box);
+    cv::resize(a, a, src.size(), 0, 0, cv::INTER_LINEAR);
+    cv::resize(b, b, src.size(), 0, 0, cv::INTER_LINEAR);
+
+    cv::Mat full;
+    src.convertTo(full, CV_32F);
+    cv::Mat out = a.mul(full) + b;
+    out.convertTo(dest, src.type());
+    return level;
+}
+
+// automatic level selection for a frame budget - keeps a running estimate of
+// the cost per unit of NLM work (pixels x searchW^2 x templateW^2) and picks
+// the finest level expected to fit the budget
+
+class NLMPyramidFilter
+{
+public:
+    NLMPyramidFilter() : msPerWork(0.0), lastLevel(0), lastTime(0.0) {}
+
+    // forget the timing history
+
+    void reset() { msPerWork = 0.0; }
+
+    // filter src within (about) budget ms - returns the level used
+
+    int filter(cv::Mat& src, cv::Mat& dest, double budget, int templeteWindowSize,
+               int searchWindowSize, double h, double sigma=0.0, int flags=NLM_DEFAULT)
+    {
+        int level = 0;
+        if(msPerWork>0.0)
+        {
+            while((level<NLM_PYRAMID_MAX_LEVELS)
+                  && (estimate(src.size(), level, templeteWindowSize, searchWindowSize)>budget))
+                level++;
+        }
+
+        const int64 pre = cv::getTickCount();
+        lastLevel = nonlocalMeansFilterPyramid(src, dest, level, templeteWindowSize, searchWindowSize,
+                                               h, sigma, flags);
+        lastTime = 1000.0*(cv::getTickCount()-pre)/cv::getTickFrequency();
+
+        // update the cost estimate (running average over the last few frames)
+        const double m = lastTime/work(src.size(), lastLevel, templeteWindowSize, searchWindowSize);
+        msPerWork = (msPerWork>0.0) ? 0.75*msPerWork+0.25*m : m;
+        return lastLevel;
+    }
+
+    // expected time (ms) of a frame of this size at this level (0 if unknown)
+
+    double estimate(const cv::Size& size, int level, int templeteWindowSize, int searchWindowSize) const
+    {
+        return msPerWork*work(size, level, templeteWindowSize, searchWindowSize);
+    }
+
+    int level() const { return lastLevel; }     // level used for the last frame
+    double time() const { return lastTime; }    // time (ms) of the last frame
+
+private:
+
+    // NLM work at a level (+ one full resolution pixel each for the pyramid /
+    // guided upsampling passes)
+
+    static double work(const cv::Size& size, int level, int templeteWindowSize, int searchWindowSize)
+    {
+        const double s = nlmPyramidSearchWindow(templeteWindowSize, searchWindowSize, level);
+        const double pixels = (double) size.area();
+        return pixels/(1<<(2*level))*s*s*templeteWindowSize*templeteWindowSize + ((level>0) ? pixels : 0.0);
+    }
+
+    double msPerWork;       // running estimate of ms per unit of work
+    int lastLevel;
+    double lastTime;
+};
+
+/******************************************************************************/
+
+#endif
@@ -16,6 +16,9 @@
 #include <string>		// standard C++ I/O
 #include <algorithm>    // includes max()
 
+#include "nlm.hpp"      // nonlocalMeansFilter() + engines
+#include "image_quality.hpp" // computeImageQuality() - MSE / PSNR / SSIM
+
 using namespace cv; // OpenCV API is in the C++ "cv" namespace
 using namespace std;
 
@@ -33,205 +36,6 @@ using namespace std;
 
 /******************************************************************************/
 
-// Non Local Mean - lifted directly from: http://opencv.jp/opencv2-x-samples/non-local-means-filter
-// Code Credit: @fukushima1981(Twitter)
-// Code provided "as is" from original source
-
-// Reference:
-// A. Buades, B. Coll, J.M. Morel “A non local algorithm for image denoising”
-// IEEE Computer Vision and Pattern Recognition 2005, Vol 2, pp: 60-65, 2005.
-
-static void nonlocalMeansFilter(Mat& src, Mat& dest, int templeteWindowSize,
-                                int searchWindowSize, double h, double sigma=0.0)
-{
-    if(templeteWindowSize>searchWindowSize)
-    {
-        std::cout<<"searchWindowSize should be larger than templeteWindowSize"<<std::endl;
-        return;
-    }
-    if(dest.empty())dest=Mat::zeros(src.size(),src.type());
-
-    const int tr = templeteWindowSize>>1;
-    const int sr = searchWindowSize>>1;
-    const int bb = sr+tr;
-    const int D = searchWindowSize*searchWindowSize;
-    const int H=D/2+1;
-    // const double div = 1.0/(double)D;//search area div
-    const int tD = templeteWindowSize*templeteWindowSize;
-    const double tdiv = 1.0/(double)(tD);//templete square div
-
-    //create large size image for bounding box;
-    Mat im;
-    copyMakeBorder(src,im,bb,bb,bb,bb,cv::BORDER_DEFAULT);
-
-    //weight computation;
-    vector<double> weight(256*256*src.channels());
-    double* w = &weight[0];
-    const double gauss_sd = (sigma == 0.0) ? h :sigma;
-    double gauss_color_coeff = -(1.0/(double)(src.channels()))*(1.0/(h*h));
-    int emax = INT_MAX;
-    for(int i = 0; i < 256*256*src.channels(); i++ )
-    {
-        double v = std::exp( max(i-2.0*gauss_sd*gauss_sd,0.0)*gauss_color_coeff);
-        w[i] = v;
-        if(v<0.001)
-        {
-            emax=i;
-            break;
-        }
-    }
-    for(int i = emax; i < 256*256*src.channels(); i++ )w[i] = 0.0;
-
-    if(src.channels()==3)
-    {
-        const int cstep = im.step-templeteWindowSize*3;
-        const int csstep = im.step-searchWindowSize*3;
-#pragma omp parallel for
-        for(int j=0;j<src.rows;j++)
-        {
-            uchar* d = dest.ptr(j);
-            int* ww=new int[D];
-            double* nw=new double[D];
-            for(int i=0;i<src.cols;i++)
-            {
-                double tweight=0.0;
-                //search loop
-                uchar* tprt = im.data +im.step*(sr+j) + 3*(sr+i);
-                uchar* sptr2 = im.data +im.step*j + 3*i;
-                for(int l=searchWindowSize,count=D-1;l--;)
-                {
-                    uchar* sptr = sptr2 +im.step*(l);
-                    for (int k=searchWindowSize;k--;)
-                    {
-                        //templete loop
-                        int e=0;
-                        uchar* t = tprt;
-                        uchar* s = sptr+3*k;
-                        for(int n=templeteWindowSize;n--;)
-                        {
-                            for(int m=templeteWindowSize;m--;)
-                            {
-                                // computing color L2 norm
-                                e += (s[0]-t[0])*(s[0]-t[0])+(s[1]-t[1])*(s[1]-t[1])+(s[2]-t[2])*(s[2]-t[2]);//L2 norm
-                                s+=3,t+=3;
-                            }
-                            t+=cstep;
-                            s+=cstep;
-                        }
-                        const int ediv = e*tdiv;
-                        ww[count--]=ediv;
-                        //get weighted Euclidean distance
-                        tweight+=w[ediv];
-                    }
-                }
-                //weight normalization
-                if(tweight==0.0)
-                {
-                    for(int z=0;z<D;z++) nw[z]=0;
-                    nw[H]=1;
-                }
-                else
-                {
-                    double itweight=1.0/(double)tweight;
-                    for(int z=0;z<D;z++) nw[z]=w[ww[z]]*itweight;
-                }
-
-                double r=0.0,g=0.0,b=0.0;
-                uchar* s = im.ptr(j+tr); s+=3*(tr+i);
-                for(int l=searchWindowSize,count=0;l--;)
-                {
-                    for(int k=searchWindowSize;k--;)
-                    {
-                        r += s[0]*nw[count];
-                        g += s[1]*nw[count];
-                        b += s[2]*nw[count++];
-                        s+=3;
-                    }
-                    s+=csstep;
-                }
-                d[0] = saturate_cast<uchar>(r);
-                d[1] = saturate_cast<uchar>(g);
-                d[2] = saturate_cast<uchar>(b);
-                d+=3;
-            }//i
-            delete[] ww;
-            delete[] nw;
-        }//j
-    }
-    else if(src.channels()==1)
-    {
-        const int cstep = im.step-templeteWindowSize;
-        const int csstep = im.step-searchWindowSize;
-#pragma omp parallel for
-        for(int j=0;j<src.rows;j++)
-        {
-            uchar* d = dest.ptr(j);
-            int* ww=new int[D];
-            double* nw=new double[D];
-            for(int i=0;i<src.cols;i++)
-            {
-                double tweight=0.0;
-                //search loop
-                uchar* tprt = im.data +im.step*(sr+j) + (sr+i);
-                uchar* sptr2 = im.data +im.step*j + i;
-                for(int l=searchWindowSize,count=D-1;l--;)
-                {
-                    uchar* sptr = sptr2 +im.step*(l);
-                    for (int k=searchWindowSize;k--;)
-                    {
-                        //templete loop
-                        int e=0;
-                        uchar* t = tprt;
-                        uchar* s = sptr+k;
-                        for(int n=templeteWindowSize;n--;)
-                        {
-                            for(int m=templeteWindowSize;m--;)
-                            {
-                                // computing color L2 norm
-                                e += (*s-*t)*(*s-*t);
-                                s++,t++;
-                            }
-                            t+=cstep;
-                            s+=cstep;
-                        }
-                        const int ediv = e*tdiv;
-                        ww[count--]=ediv;
-                        //get weighted Euclidean distance
-                        tweight+=w[ediv];
-                    }
-                }
-                //weight normalization
-                if(tweight==0.0)
-                {
-                    for(int z=0;z<D;z++) nw[z]=0;
-                    nw[H]=1;
-                }
-                else
-                {
-                    double itweight=1.0/(double)tweight;
-                    for(int z=0;z<D;z++) nw[z]=w[ww[z]]*itweight;
-                }
-
-                double v=0.0;
-                uchar* s = im.ptr(j+tr); s+=(tr+i);
-                for(int l=searchWindowSize,count=0;l--;)
-                {
-                    for(int k=searchWindowSize;k--;)
-                    {
-                        v += *(s++)*nw[count++];
-                    }
-                    s+=csstep;
-                }
-                 *(d++) = saturate_cast<uchar>(v);
-            }//i
-            delete[] ww;
-            delete[] nw;
-        }//j
-    }
-}
-
-/******************************************************************************/
-
 int main( int argc, char** argv )
 {
 
@@ -254,6 +58,19 @@ int main( int argc, char** argv )
   int searchWindowSize = 7;
   int h = 3;
   int hc = 10;
+  int localNLM = 0;             // 0 = OpenCV fastNlMeansDenoising(), 1 = nlm.hpp version
+  int frames = 1;               // K > 1 uses spatio-temporal NLM over the last K frames
+  int budget = 0;               // frame budget (ms) for the pyramid preview of local NLM (0 = off)
+
+  TemporalNLMFilter temporalNLM; // ring buffer of the last K frames
+
+  NLMDistanceCache distanceCache; // template distances of a still image (h changes only reweight)
+  bool cached = false;          // output came from the distance cache
+
+  NLMPyramidFilter pyramidNLM;  // budget driven pyramid level selection
+  bool pyramid = false;         // output came from the pyramid preview
+
+  NLMScratchStats scratchStats = getNLMScratchStats(); // scratch allocation counters
 
   // check which version of OpenCV we are using
 
@@ -281,6 +98,9 @@ int main( int argc, char** argv )
         createTrackbar("search W", windowName2, &searchWindowSize, 50);
         createTrackbar("h", windowName2, &h, 25);
         createTrackbar("hc", windowName2, &hc, 25);
+        createTrackbar("local NLM", windowName2, &localNLM, 1);
+        createTrackbar("frames K", windowName2, &frames, NLM_TEMPORAL_MAX_FRAMES);
+        createTrackbar("budget ms", windowName2, &budget, 200);
 
 	  // start main loop
 
@@ -324,13 +144,53 @@ int main( int argc, char** argv )
 
             // in OpenCV version 2.4.2 and earlier we use this version
 
-            nonlocalMeansFilter(img,output, templateWindowSize, searchWindowSize, (double) h, (double) h);
+            if (frames > 1)
+            {
+                temporalNLM.filter(img, output, frames, templateWindowSize, searchWindowSize, (double) h, (double) h);
+            } else {
+                nonlocalMeansFilter(img,output, templateWindowSize, searchWindowSize, (double) h, (double) h);
+            }
 
           #else
 
-            // use version built-in to later versions of OpenCV
+            // use version built-in to later versions of OpenCV (unless local NLM
+            // selected on the trackbar)
+
+            if (frames > 1)
+            {
+                // spatio-temporal NLM - search window spans the last K frames
 
-            if (img.channels() == 3) // if RGB then use colour function on L*a*b colour space (see manual)
+                temporalNLM.filter(img, output, frames, templateWindowSize, searchWindowSize, (double) h, (double) h);
+            }
+            else if (localNLM && (budget > 0))
+            {
+                // pyramid preview - the finest level expected to fit the budget
+
+                pyramidNLM.filter(img, output, (double) budget, templateWindowSize, searchWindowSize, (double) h, (double) h);
+                pyramid = true;
+            }
+            else if (localNLM && !cap.isOpened())
+            {
+                // still image - the template distances do not depend on h, so
+                // compute them once and only rerun the weighting when h changes
+
+                if (!distanceCache.matches(img, templateWindowSize, searchWindowSize))
+                {
+                    distanceCache.compute(img, templateWindowSize, searchWindowSize);
+                }
+                cached = distanceCache.matches(img, templateWindowSize, searchWindowSize);
+                if (cached)
+                {
+                    distanceCache.filter(output, (double) h, (double) h);
+                } else {
+                    nonlocalMeansFilter(img,output, templateWindowSize, searchWindowSize, (double) h, (double) h);
+                }
+            }
+            else if (localNLM)
+            {
+                nonlocalMeansFilter(img,output, templateWindowSize, searchWindowSize, (double) h, (double) h);
+            }
+            else if (img.channels() == 3) // if RGB then use colour function on L*a*b colour space (see manual)
             {
                 fastNlMeansDenoisingColored(img, output, h, hc, templateWindowSize, searchWindowSize);
             } else {
@@ -342,7 +202,40 @@ int main( int argc, char** argv )
 
           #endif
 
-          std::cout << "time: " << 1000.0*(getTickCount()-pre)/(getTickFrequency()) << " ms" <<  std::endl;
+          std::cout << "time: " << 1000.0*(getTickCount()-pre)/(getTickFrequency()) << " ms";
+          if (frames > 1)
+          {
+              std::cout << " (" << temporalNLM.size() << " frames)";
+          } else {
+              temporalNLM.reset(); // do not reuse stale frames if K is raised again
+          }
+          if (pyramid)
+          {
+              std::cout << " (pyramid level " << pyramidNLM.level() << ", budget " << budget << " ms)";
+              pyramid = false;
+          }
+          if (cached)
+          {
+              std::cout << " (cached distances, " << distanceCache.bytes() / (1024 * 1024) << " MB)";
+              cached = false;
+          }
+          std::cout << std::endl;
+
+          // log the change made by the filter to this frame (output vs. input)
+
+          std::cout << "quality: " << computeImageQuality(img, output) << std::endl;
+
+          // report scratch buffer (re)allocations made by nonlocalMeansFilter() for
+          // this frame - zero once the per-thread arenas have reached steady state
+
+          if (localNLM)
+          {
+              NLMScratchStats stats = getNLMScratchStats();
+              std::cout << "scratch: " << (stats.allocations - scratchStats.allocations)
+                        << " allocations / " << (stats.requests - scratchStats.requests)
+                        << " requests (" << stats.bytes << " bytes held)" << std::endl;
+              scratchStats = stats;
+          }
 
 		  // display image in window
 
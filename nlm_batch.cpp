@@ -0,0 +1,449 @@
+// Example : offline batch Non-Local Means (NLM) denoising of an image directory
+// or a video file (no GUI)
+// usage: prog [options] <input_dir | input_video> <output_dir | output_video>
+
+// Decoding, filtering and encoding run as separate pipeline stages connected
+// by bounded queues, so that file I/O overlaps with the filtering and memory
+// use stays bounded however long the input is:
+
+//   decode thread --> [ input queue ] --> W filter workers --> [ reorder buffer ] --> encode thread
+
+// Each filter worker denoises whole frames with nonlocalMeansFilter() using its
+// own share of the cores (OpenMP threads), so several frames are filtered at
+// once - keeping all the cores busy even when a single frame has too few rows
+// to occupy them all. The encoder writes frames back in input order.
+
+// options:
+//   -t N     template window size            (default 3)
+//   -s N     search window size              (default 7)
+//   -h X     filter strength h (= sigma)     (default 15)
+//   -w N     filter workers (frames in flight, default chosen from the frame size)
+//   -q N     queue capacity (frames)         (default 2 x workers)
+
+// For a directory every image file in it is processed and written with the same
+// name to the (existing) output directory; for a video the output is written
+// with the codec and frame rate of the input. h is given for the 0-255 range
+// (scaled for 16-bit / float images); an alpha channel is passed through
+// unfiltered, and frames of other types are reported and written unfiltered.
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#include "opencv2/videoio.hpp"
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <string>		// standard C++ I/O
+#include <vector>		// standard C++ containers
+#include <deque>		// standard C++ containers
+#include <map>		    // standard C++ containers
+#include <algorithm>    // includes max()
+#include <cstdlib>      // includes atoi(), atof()
+#include <cstring>      // includes strcmp()
+#include <thread>       // standard C++ threads
+#include <mutex>        // standard C++ mutexes
+#include <condition_variable>
+
+#include "nlm.hpp"      // nonlocalMeansFilter() + engines
+
+using namespace cv; // OpenCV API is in the C++ "cv" namespace
+using namespace std;
+
+/******************************************************************************/
+
+#define NLM_BATCH_ROWS_PER_THREAD 64  // frame rows per OpenMP thread (worker sizing)
+
+// one frame travelling through the pipeline
+
+struct Frame
+{
+    int index;          // position in the input (output order)
+    string name;        // file name (directory input)
+    Mat image;
+};
+
+/******************************************************************************/
+
+// first in first out queue of bounded capacity - push() blocks while full,
+// pop() blocks while empty; once closed pop() drains what is left and then
+// returns false
+
+class FrameQueue
+{
+public:
+    explicit FrameQueue(size_t capacity) : capacity(capacity), closed(false), stalls(0) {}
+
+    void push(const Frame& frame)
+    {
+        unique_lock<mutex> lock(m);
+        if (q.size() >= capacity) stalls++;
+        while (q.size() >= capacity) notFull.wait(lock);
+        q.push_back(frame);
+        notEmpty.notify_one();
+    }
+
+    bool pop(Frame& frame)
+    {
+        unique_lock<mutex> lock(m);
+        while (q.empty() && !closed) notEmpty.wait(lock);
+        if (q.empty()) return false;
+        frame = q.front();
+        q.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        unique_lock<mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+    int stallCount() { unique_lock<mutex> lock(m); return stalls; }
+
+private:
+    size_t capacity;
+    bool closed;
+    int stalls;             // number of push() calls that found the queue full
+    deque<Frame> q;
+    mutex m;
+    condition_variable notFull, notEmpty;
+};
+
+// frames finished out of order are held here until all the frames before them
+// are done - push() blocks if a frame is more than capacity frames ahead of
+// the next one to be written (bounding the memory held)
+
+class ReorderBuffer
+{
+public:
+    explicit ReorderBuffer(size_t capacity) : capacity(capacity), next(0), closed(false) {}
+
+    void push(const Frame& frame)
+    {
+        unique_lock<mutex> lock(m);
+        while (frame.index >= next + (int) capacity) space.wait(lock);
+        frames[frame.index] = frame;
+        ready.notify_all();
+    }
+
+    // next frame in input order (false once closed and empty)
+
+    bool pop(Frame& frame)
+    {
+        unique_lock<mutex> lock(m);
+        while ((frames.empty() || (frames.begin()->first != next)) && !closed) ready.wait(lock);
+        if (frames.empty()) return false;
+        frame = frames.begin()->second;     // (lowest index left if closed)
+        frames.erase(frames.begin());
+        next = frame.index + 1;
+        space.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        unique_lock<mutex> lock(m);
+        closed = true;
+        ready.notify_all();
+    }
+
+private:
+    size_t capacity;
+    int next;               // index of the next frame to write
+    bool closed;
+    map<int, Frame> frames;
+    mutex m;
+    condition_variable space, ready;
+};
+
+/******************************************************************************/
+
+// denoise one frame - h / sigma given for 8-bit images are scaled to the depth
+// of the frame (as in nlm.cpp), an alpha channel (2 / 4 channel frames) is
+// split off and put back unfiltered; false if the frame type is not supported
+
+bool denoiseFrame(Mat& src, Mat& dest, int templateWindowSize, int searchWindowSize, double h)
+{
+    const int cn = src.channels();
+    const int depth = src.depth();
+    if (((depth != CV_8U) && (depth != CV_16U) && (depth != CV_32F)) || (cn < 1) || (cn > 4))
+    {
+        return false;
+    }
+
+    if (depth == CV_16U) h *= 257.0;
+    else if (depth == CV_32F) h /= 255.0;
+
+    if ((cn == 2) || (cn == 4))
+    {
+        vector<Mat> planes;
+        split(src, planes);
+        Mat alpha = planes.back();
+        planes.pop_back();
+
+        Mat colour, filtered;
+        merge(planes, colour);
+        nonlocalMeansFilter(colour, filtered, templateWindowSize, searchWindowSize, h, h);
+        if (filtered.empty()) return false;
+
+        split(filtered, planes);
+        planes.push_back(alpha);
+        merge(planes, dest);
+        return true;
+    }
+
+    nonlocalMeansFilter(src, dest, templateWindowSize, searchWindowSize, h, h);
+    return !dest.empty();
+}
+
+/******************************************************************************/
+
+// frame source / sink - a directory of images or a video file
+
+class FrameSource
+{
+public:
+    FrameSource() : next(0) {}
+
+    bool open(const string& path)
+    {
+        vector<String> all;
+        glob(path, all, false);     // lists the files if path is a directory
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            if (haveImageReader(all[i])) files.push_back(all[i]);
+        }
+        if (!files.empty()) return true;
+        return cap.open(path);
+    }
+
+    bool isVideo() const { return cap.isOpened(); }
+
+    // (query before the decode thread starts - VideoCapture is not thread safe)
+
+    double fps() { return cap.get(CAP_PROP_FPS); }
+    int fourcc() { return (int) cap.get(CAP_PROP_FOURCC); }
+
+    bool read(Frame& frame)
+    {
+        frame.index = next;
+        frame.image.release();  // (never decode into a buffer still shared with a queued frame)
+        if (isVideo())
+        {
+            cap >> frame.image;
+        } else {
+            if (next >= (int) files.size()) return false;
+            frame.name = files[next].substr(files[next].find_last_of("/\\") + 1);
+            frame.image = imread(files[next], IMREAD_UNCHANGED);
+        }
+        if (frame.image.empty()) return false;
+        next++;
+        return true;
+    }
+
+private:
+    vector<string> files;
+    VideoCapture cap;
+    int next;
+};
+
+class FrameSink
+{
+public:
+    // isVideo, fourcc, fps - of the source, read once before the pipeline starts
+
+    FrameSink(const string& path, bool isVideo, int fourcc, double fps)
+        : path(path), isVideo(isVideo), fourcc(fourcc), fps((fps > 0) ? fps : 25.0) {}
+
+    bool write(const Frame& frame)
+    {
+        if (isVideo)
+        {
+            if (!video.isOpened()
+                && !video.open(path, fourcc, fps, frame.image.size(), frame.image.channels() == 3))
+            {
+                return false;
+            }
+            video << frame.image;
+            return true;
+        }
+        return imwrite(path + "/" + frame.name, frame.image);
+    }
+
+private:
+    string path;
+    bool isVideo;
+    int fourcc;
+    double fps;
+    VideoWriter video;
+};
+
+/******************************************************************************/
+
+int main( int argc, char** argv )
+{
+    int templateWindowSize = 3;
+    int searchWindowSize = 7;
+    double h = 15.0;
+    int workers = 0;
+    int capacity = 0;
+    vector<string> paths;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const bool hasValue = (i + 1 < argc);
+        if (!strcmp(argv[i], "-t") && hasValue) templateWindowSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && hasValue) searchWindowSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-h") && hasValue) h = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-w") && hasValue) workers = max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "-q") && hasValue) capacity = max(1, atoi(argv[++i]));
+        else paths.push_back(argv[i]);
+    }
+    if (paths.size() != 2)
+    {
+        std::cout << "usage: " << argv[0] << " [-t template_W] [-s search_W] [-h h] [-w workers] [-q queue]"
+                  << " <input_dir | input_video> <output_dir | output_video>" << std::endl;
+        return -1;
+    }
+
+    FrameSource source;
+    Frame first;
+    if (!source.open(paths[0]) || !source.read(first))
+    {
+        std::cerr << "ERROR: cannot read images / video from " << paths[0] << std::endl;
+        return -1;
+    }
+    FrameSink sink(paths[1], source.isVideo(), source.isVideo() ? source.fourcc() : 0,
+                   source.isVideo() ? source.fps() : 0.0);
+
+    // size the workers from the first frame - each gets enough OpenMP threads
+    // for its rows, and the cores left over filter further frames concurrently
+
+    const int cores = getNumberOfCPUs();
+    if (workers == 0)
+    {
+        const int threadsPerFrame = max(1, min(cores, first.image.rows / NLM_BATCH_ROWS_PER_THREAD));
+        workers = max(1, cores / threadsPerFrame);
+    }
+    const int threadsPerWorker = max(1, cores / workers);
+    if (capacity == 0)
+    {
+        capacity = 2 * workers;
+    }
+
+    std::cout << (source.isVideo() ? "video" : "directory") << " input, "
+              << first.image.cols << " x " << first.image.rows << " x " << first.image.channels()
+              << ", " << workers << " filter workers x " << threadsPerWorker << " threads, queues of "
+              << capacity << " frames" << std::endl;
+
+    FrameQueue input(capacity);
+    ReorderBuffer output(capacity);
+    double decodeTime = 0.0, encodeTime = 0.0;
+    vector<double> filterTime(workers, 0.0);
+    vector<int> filtered(workers, 0);
+    vector<int> unsupported(workers, 0);
+    int written = 0;
+    bool writeOk = true;
+
+    int64 start = getTickCount();
+
+    // decode stage
+
+    thread decoder([&]()
+    {
+        Frame frame = first;
+        do
+        {
+            input.push(frame);
+            int64 pre = getTickCount();
+            bool more = source.read(frame);
+            decodeTime += 1000.0 * (getTickCount() - pre) / getTickFrequency();
+            if (!more) break;
+        } while (true);
+        input.close();
+    });
+
+    // filter stage - W workers, each with its own OpenMP thread count (an
+    // OpenMP setting of the calling thread) and its own scratch arenas
+
+    vector<thread> filters;
+    for (int w = 0; w < workers; w++)
+    {
+        filters.push_back(thread([&, w]()
+        {
+        #ifdef _OPENMP
+            omp_set_num_threads(threadsPerWorker);
+        #endif
+            Frame frame;
+            while (input.pop(frame))
+            {
+                int64 pre = getTickCount();
+                Mat dest;
+                if (denoiseFrame(frame.image, dest, templateWindowSize, searchWindowSize, h))
+                {
+                    frame.image = dest;
+                } else {
+                    unsupported[w]++;   // (passed through unfiltered, reported below)
+                }
+                filterTime[w] += 1000.0 * (getTickCount() - pre) / getTickFrequency();
+                filtered[w]++;
+                output.push(frame);
+            }
+        }));
+    }
+
+    // encode stage (in input order)
+
+    thread encoder([&]()
+    {
+        Frame frame;
+        while (output.pop(frame))
+        {
+            int64 pre = getTickCount();
+            writeOk = sink.write(frame) && writeOk;
+            encodeTime += 1000.0 * (getTickCount() - pre) / getTickFrequency();
+            written++;
+            if ((written % 10) == 0) std::cout << "\rframes " << written << std::flush;
+        }
+    });
+
+    decoder.join();
+    for (int w = 0; w < workers; w++) filters[w].join();
+    output.close();
+    encoder.join();
+
+    // report - per stage busy time against the wall clock time shows how well
+    // the I/O was overlapped with the filtering
+
+    double total = 1000.0 * (getTickCount() - start) / getTickFrequency();
+    std::cout << "\rframes " << written << ": " << total << " ms ("
+              << 1000.0 * written / max(total, 1e-9) << " fps)" << std::endl;
+    std::cout << "  decode busy " << decodeTime << " ms, encode busy " << encodeTime
+              << " ms, input queue full " << input.stallCount() << " times" << std::endl;
+    for (int w = 0; w < workers; w++)
+    {
+        std::cout << "  worker " << w << ": " << filtered[w] << " frames, busy " << filterTime[w]
+                  << " ms (" << 100.0 * filterTime[w] / max(total, 1e-9) << "%)" << std::endl;
+    }
+
+    int skipped = 0;
+    for (int w = 0; w < workers; w++) skipped += unsupported[w];
+    if (skipped > 0)
+    {
+        std::cerr << "ERROR: " << skipped << " frames of an unsupported type (depth / channels)"
+                  << " were written unfiltered" << std::endl;
+    }
+
+    if (!writeOk)
+    {
+        std::cerr << "ERROR: failed writing to " << paths[1] << std::endl;
+        return -1;
+    }
+    return (skipped > 0) ? -1 : 0;
+}
+/******************************************************************************/
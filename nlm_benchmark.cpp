@@ -0,0 +1,235 @@
+// Example : benchmark the Non-Local Means (NLM) kernels from nlm.hpp
+// usage: prog [<image_name> [<repeats>]]
+
+// Times the generic (runtime sized) loops against the compile-time specialised
+// instance for each specialised (template W, search W) pair, for both grayscale
+// and colour input, and checks that both produce identical output. Then times
+// parallel rows against the tiled (work stealing) execution and reports the
+// per-thread load balance of the tiled runs, and finally the latency / quality
+// (against the noise free image) trade-off of each pyramid preview level.
+// (if no image is given a synthetic textured 640x480 image is used)
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <iomanip>		// standard C++ I/O formatting
+#include <string>		// standard C++ I/O
+#include <vector>		// standard C++ containers
+#include <algorithm>    // includes sort()
+#include <cstdlib>      // includes atoi()
+
+#include "nlm.hpp"      // nonlocalMeansFilter() + engines
+#include "noise.hpp"    // addNoise() - deterministic parallel noise
+#include "image_quality.hpp" // computeImageQuality() - MSE / PSNR / SSIM
+
+using namespace cv; // OpenCV API is in the C++ "cv" namespace
+using namespace std;
+
+/******************************************************************************/
+
+// median run time (ms) of nonlocalMeansFilter() over repeats runs (+1 warm up);
+// tileStats, if given, receives the per-thread statistics of the last NLM_TILED run
+
+static double timeNLM(Mat& src, Mat& dest, int templateW, int searchW,
+                      double h, int flags, int repeats,
+                      vector<NLMThreadStats>* tileStats = NULL)
+{
+    vector<double> times;
+
+    for (int r = 0; r <= repeats; r++)
+    {
+        dest.release();
+        int64 pre = getTickCount();
+        nonlocalMeansFilter(src, dest, templateW, searchW, h, h, flags, NLM_MIN_WEIGHT, tileStats);
+        if (r > 0) // skip warm up run (scratch arenas are allocated here)
+        {
+            times.push_back(1000.0 * (getTickCount() - pre) / getTickFrequency());
+        }
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// median run time (ms) of nonlocalMeansFilterPyramid() at a given level (used
+// receives the level actually run - lower if the image is too small for level)
+
+static double timeNLMPyramid(Mat& src, Mat& dest, int level, int templateW, int searchW,
+                             double h, int repeats, int& used)
+{
+    vector<double> times;
+
+    for (int r = 0; r <= repeats; r++)
+    {
+        int64 pre = getTickCount();
+        used = nonlocalMeansFilterPyramid(src, dest, level, templateW, searchW, h, h);
+        if (r > 0)
+        {
+            times.push_back(1000.0 * (getTickCount() - pre) / getTickFrequency());
+        }
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+/******************************************************************************/
+
+int main( int argc, char** argv )
+{
+    const double noise_sigma = 15.0;
+    int repeats = 5;
+    Mat img;
+
+    if (argc >= 2)
+    {
+        img = imread(argv[1], IMREAD_COLOR);
+        if (img.empty())
+        {
+            std::cerr << "ERROR: cannot read image " << argv[1] << std::endl;
+            return -1;
+        }
+    } else {
+
+        // synthetic textured image
+
+        img.create(480, 640, CV_8UC3);
+        randu(img, Scalar::all(0), Scalar::all(255));
+        GaussianBlur(img, img, Size(0, 0), 3);
+        normalize(img, img, 0, 255, NORM_MINMAX);
+    }
+    if (argc >= 3)
+    {
+        repeats = max(1, atoi(argv[2]));
+    }
+
+    std::cout << "image: " << img.cols << " x " << img.rows
+              << ", median of " << repeats << " runs" << std::endl << std::endl;
+
+    // grayscale and colour versions of the noisy input
+
+    Mat gray;
+    cvtColor(img, gray, COLOR_BGR2GRAY);
+    Mat inputs[2];
+    Mat clean[2] = { gray, img };
+    addNoise(gray, inputs[0], noise_sigma);
+    addNoise(img, inputs[1], noise_sigma);
+
+    // one line per specialised instance
+
+    const int sizes[][2] = {
+#define NLM_BENCHMARK_SIZE(TW, SW) { TW, SW },
+        NLM_SPECIALISED_SIZES(NLM_BENCHMARK_SIZE)
+#undef NLM_BENCHMARK_SIZE
+    };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    std::cout << "instance         generic (ms)  specialised (ms)  speedup  identical" << std::endl;
+
+    for (int c = 0; c < 2; c++)
+    {
+        for (int i = 0; i < nsizes; i++)
+        {
+            Mat destGeneric, destSpecialised;
+
+            double tGeneric = timeNLM(inputs[c], destGeneric, sizes[i][0], sizes[i][1],
+                                      noise_sigma, NLM_GENERIC, repeats);
+            double tSpecialised = timeNLM(inputs[c], destSpecialised, sizes[i][0], sizes[i][1],
+                                          noise_sigma, NLM_DEFAULT, repeats);
+
+            std::cout << setw(2) << sizes[i][0] << "/" << setw(2) << left << sizes[i][1] << right
+                      << " x " << inputs[c].channels() << "ch"
+                      << fixed << setprecision(2)
+                      << setw(15) << tGeneric << setw(18) << tSpecialised
+                      << setw(8) << tGeneric / tSpecialised << "x"
+                      << setw(10) << ((norm(destGeneric, destSpecialised, NORM_INF) == 0) ? "yes" : "NO")
+                      << std::endl;
+        }
+    }
+
+    // parallel rows vs. tiled execution (+ load balance of the last tiled run)
+
+    std::cout << std::endl
+              << "instance         rows (ms)  tiled (ms)  tiles  stolen  busy max/mean  identical" << std::endl;
+
+    vector<NLMThreadStats> threadStats;
+    for (int c = 0; c < 2; c++)
+    {
+        for (int i = 0; i < nsizes; i++)
+        {
+            Mat destRows, destTiled;
+
+            double tRows = timeNLM(inputs[c], destRows, sizes[i][0], sizes[i][1],
+                                   noise_sigma, NLM_DEFAULT, repeats);
+            double tTiled = timeNLM(inputs[c], destTiled, sizes[i][0], sizes[i][1],
+                                    noise_sigma, NLM_TILED, repeats, &threadStats);
+
+            int tiles = 0, stolen = 0;
+            double busyMax = 0.0, busySum = 0.0;
+            for (size_t t = 0; t < threadStats.size(); t++)
+            {
+                tiles += threadStats[t].tiles;
+                stolen += threadStats[t].stolen;
+                busyMax = max(busyMax, threadStats[t].busy);
+                busySum += threadStats[t].busy;
+            }
+
+            std::cout << setw(2) << sizes[i][0] << "/" << setw(2) << left << sizes[i][1] << right
+                      << " x " << inputs[c].channels() << "ch"
+                      << fixed << setprecision(2)
+                      << setw(12) << tRows << setw(12) << tTiled
+                      << setw(7) << tiles << setw(8) << stolen
+                      << setw(15) << busyMax / max(busySum / threadStats.size(), 1e-9)
+                      << setw(11) << ((norm(destRows, destTiled, NORM_INF) == 0) ? "yes" : "NO")
+                      << std::endl;
+        }
+    }
+
+    // per-thread busy time of the last tiled run
+
+    std::cout << std::endl << "per-thread busy time (last tiled run):" << std::endl;
+    for (size_t t = 0; t < threadStats.size(); t++)
+    {
+        std::cout << "  thread " << setw(3) << t << ": " << setw(9) << threadStats[t].busy << " ms, "
+                  << threadStats[t].tiles << " tiles (" << threadStats[t].stolen << " stolen)" << std::endl;
+    }
+
+    // pyramid preview levels - latency vs. quality (against the noise free image)
+
+    std::cout << std::endl
+              << "instance         level  search W  time (ms)  PSNR (dB)    SSIM" << std::endl;
+
+    for (int c = 0; c < 2; c++)
+    {
+        for (int i = 0; i < nsizes; i++)
+        {
+            for (int level = 0; level <= NLM_PYRAMID_MAX_LEVELS; level++)
+            {
+                Mat dest;
+                int used = level;
+                double t = timeNLMPyramid(inputs[c], dest, level, sizes[i][0], sizes[i][1],
+                                          noise_sigma, repeats, used);
+                if (used < level)
+                {
+                    break;  // image too small for this level (already timed at used)
+                }
+                ImageQuality quality = computeImageQuality(clean[c], dest);
+
+                std::cout << setw(2) << sizes[i][0] << "/" << setw(2) << left << sizes[i][1] << right
+                          << " x " << inputs[c].channels() << "ch"
+                          << setw(7) << used
+                          << setw(10) << nlmPyramidSearchWindow(sizes[i][0], sizes[i][1], used)
+                          << fixed << setprecision(2)
+                          << setw(11) << t << setw(11) << quality.psnr
+                          << setprecision(4) << setw(8) << quality.ssim << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
+/******************************************************************************/
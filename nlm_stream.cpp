@@ -0,0 +1,107 @@
+// Example : streaming (out of core) Non-Local Means (NLM) for very large images
+// usage: prog <input.pnm> <output.pnm> [<band_rows> [<template_W> <search_W> <h>]]
+
+// The input is read, denoised and written in horizontal bands of band_rows rows
+// (each with the sr+tr halo rows it needs) so that peak memory use is bounded
+// by the band height rather than the image height. Input / output are binary
+// PGM (P5, grayscale) or PPM (P6, colour) files, 8 or 16-bit, which can be
+// streamed row by row (convert other formats first, e.g. with "convert big.tif
+// big.ppm"). h is given for the 0-255 range and scaled to the file's maxval.
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#include "opencv2/core.hpp"
+
+#include <iostream>		// standard C++ I/O
+#include <string>		// standard C++ I/O
+#include <cstdlib>      // includes atoi(), atof()
+
+#include "nlm.hpp"          // nonlocalMeansFilterStream() + engines
+#include "pnm_stream.hpp"   // PNMReader / PNMWriter / PNMProgressSink
+
+using namespace cv; // OpenCV API is in the C++ "cv" namespace
+using namespace std;
+
+/******************************************************************************/
+
+int main( int argc, char** argv )
+{
+    int bandRows = 256;
+    int templateWindowSize = 3;
+    int searchWindowSize = 7;
+    double h = 15.0;
+
+    if (argc < 3)
+    {
+        std::cout << "usage: " << argv[0]
+                  << " <input.pnm> <output.pnm> [<band_rows> [<template_W> <search_W> <h>]]" << std::endl;
+        return -1;
+    }
+    if (argc >= 4)
+    {
+        bandRows = max(1, atoi(argv[3]));
+    }
+    if (argc >= 7)
+    {
+        templateWindowSize = atoi(argv[4]);
+        searchWindowSize = atoi(argv[5]);
+        h = atof(argv[6]);
+    }
+
+    PNMReader in;
+    if (!in.open(argv[1]))
+    {
+        std::cerr << "ERROR: cannot read binary PGM / PPM (8 / 16-bit) image " << argv[1] << std::endl;
+        return -1;
+    }
+    PNMWriter writer;
+    if (!writer.open(argv[2], in.rows(), in.cols(), in.type(), in.maxValue()))
+    {
+        std::cerr << "ERROR: cannot write image " << argv[2] << std::endl;
+        return -1;
+    }
+
+    // working memory - source window, bordered band (+ spare row), output band
+
+    const int bb = (searchWindowSize >> 1) + (templateWindowSize >> 1);
+    const int band = min(bandRows, in.rows());
+    const int pixelBytes = CV_MAT_CN(in.type()) * ((CV_MAT_DEPTH(in.type()) == CV_16U) ? 2 : 1);
+    const double bandBytes = ((double) (band + 2 * bb) * in.cols() * 2
+                              + (double) (band + 2 * bb + 1) * (in.cols() + 2 * bb)
+                              + (double) band * in.cols()) * pixelBytes;
+
+    std::cout << "image: " << in.cols() << " x " << in.rows() << " x " << CV_MAT_CN(in.type())
+              << " (" << (double) in.rows() * in.cols() * pixelBytes / (1024.0 * 1024.0) << " MB)"
+              << ", bands of " << band << " rows, working memory "
+              << bandBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+
+    PNMProgressSink out(writer, in.rows());
+
+    // 16-bit files use the float pipeline, with h relative to their maxval
+
+    h *= in.maxValue() / 255.0;
+
+    int64 pre = getTickCount();
+    bool readOk = nonlocalMeansFilterStream(in, out, templateWindowSize, searchWindowSize, h, h, bandRows);
+    double t = (getTickCount() - pre) / getTickFrequency();
+
+    std::cout << std::endl << "NLM (streaming) time: " << 1000.0 * t << " ms ("
+              << (double) in.rows() * in.cols() / (1000000.0 * t) << " MPix/s)" << std::endl;
+
+    if (!readOk)
+    {
+        std::cerr << "ERROR: failed reading " << argv[1] << std::endl;
+        return -1;
+    }
+    if (!out.ok || (writer.rowsWritten() != in.rows()))
+    {
+        std::cerr << "ERROR: failed writing " << argv[2] << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
+/******************************************************************************/
@@ -0,0 +1,205 @@
+// Deterministic parallel noise generation (Gaussian, salt & pepper) for the
+// denoising examples - shared by nlm.cpp / nlm_benchmark.cpp
+
+// A counter based generator: every random value is a pure function of
+// (seed, stream, row, column) - a per-row key is derived from (seed, stream,
+// row) and the values of the row are a hash of (key, column counter) - so rows
+// can be generated in any order, on any number of threads, and the noise is
+// bit-reproducible for a given seed (unlike a cv::RNG shared between threads).
+// The per element code is branch free 32-bit integer / float arithmetic
+// (hash, polynomial log / cos / sqrt) so the compiler vectorises the row loops.
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#ifndef NOISE_HPP
+#define NOISE_HPP
+
+#include "opencv2/core.hpp"
+
+#include <vector>		// standard C++ containers
+#include <cstring>      // includes memcpy()
+
+#define NOISE_DEFAULT_SEED 0x2545F4914F6CDD1DULL
+
+/******************************************************************************/
+// generator core
+
+// per-row key (SplitMix64 finaliser of seed / stream / row)
+
+inline unsigned int noiseRowKey(uint64 seed, unsigned int stream, int row)
+{
+    uint64 z = seed + 0x9E3779B97F4A7C15ULL*((((uint64) stream)<<32) + (unsigned int) row + 1);
+    z = (z ^ (z>>30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z>>27))*0x94D049BB133111EBULL;
+    return (unsigned int) (z ^ (z>>31));
+}
+
+// 32-bit hash of (key, counter) - Weyl step + MurmurHash3 finaliser
+
+inline unsigned int noiseHash(unsigned int key, unsigned int counter)
+{
+    unsigned int h = key + counter*0x9E3779B9u;
+    h ^= h>>16; h *= 0x85EBCA6Bu;
+    h ^= h>>13; h *= 0xC2B2AE35u;
+    h ^= h>>16;
+    return h;
+}
+
+// uniform in (0,1] from the top 24 bits of a hash
+
+inline float noiseToUniform(unsigned int h)
+{
+    return (float) ((h>>8)+1)*(1.0f/16777216.0f);
+}
+
+// natural log of x in (0,1] - exponent + atanh series of the mantissa
+// (relative error < 1e-6)
+
+inline float noiseLog(float x)
+{
+    int bits;
+    memcpy(&bits, &x, sizeof(bits));
+    const float e = (float) ((bits>>23)-127);
+    bits = (bits & 0x007FFFFF) | 0x3F800000;
+    float m;
+    memcpy(&m, &bits, sizeof(m));               // mantissa in [1,2)
+    const float t = (m-1.0f)/(m+1.0f);
+    const float t2 = t*t;
+    const float p = 2.0f+t2*(2.0f/3.0f+t2*(2.0f/5.0f+t2*(2.0f/7.0f+t2*(2.0f/9.0f))));
+    return e*0.69314718f + t*p;
+}
+
+// cos(2*pi*u) for u in [0,1) - Taylor series about u = 0.5 (abs error < 2e-7)
+
+inline float noiseCos2Pi(float u)
+{
+    const float y = 6.28318531f*(u-0.5f);       // in [-pi,pi)
+    const float y2 = y*y;
+    const float c = 1.0f+y2*(-1.0f/2+y2*(1.0f/24+y2*(-1.0f/720+y2*(1.0f/40320
+                    +y2*(-1.0f/3628800+y2*(1.0f/479001600+y2*(-1.0f/87178291200.0f
+                    +y2*(1.0f/20922789888000.0f))))))));
+    return -c;
+}
+
+// square root of x >= 0 - bit estimate of 1/sqrt(x) + Newton steps (relative
+// error < 1e-6; unlike std::sqrt it has no errno path so the loops vectorise)
+
+inline float noiseSqrt(float x)
+{
+    int bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = 0x5F3759DF - (bits>>1);
+    float y;
+    memcpy(&y, &bits, sizeof(y));
+    y = y*(1.5f-0.5f*x*y*y);
+    y = y*(1.5f-0.5f*x*y*y);
+    y = y*(1.5f-0.5f*x*y*y);
+    return x*y;
+}
+
+/******************************************************************************/
+// row samplers - dst[i] for i in [0,n) depends only on (key, i)
+
+// uniform in (0,1]; counters [offset, offset+n)
+
+inline void noiseUniform(unsigned int key, float* dst, int n, unsigned int offset=0)
+{
+    for(int i=0;i<n;i++) dst[i] = noiseToUniform(noiseHash(key, offset+i));
+}
+
+// standard normal N(0,1) - Box-Muller (cosine branch) of counters 2i, 2i+1
+
+inline void noiseNormal(unsigned int key, float* dst, int n)
+{
+    for(int i=0;i<n;i++)
+    {
+        const float u1 = noiseToUniform(noiseHash(key, 2*i));
+        const float u2 = noiseToUniform(noiseHash(key, 2*i+1)) - (1.0f/16777216.0f);
+        dst[i] = noiseSqrt(-2.0f*noiseLog(u1))*noiseCos2Pi(u2);
+    }
+}
+
+/******************************************************************************/
+// noise functions (8-bit single channel, src and dest may be the same image)
+
+// salt & pepper - a fraction per of the pixels set to 0 or 255 (equally likely)
+
+inline void addNoiseSoltPepperMono(cv::Mat& src, cv::Mat& dest, double per,
+                                   uint64 seed=NOISE_DEFAULT_SEED, unsigned int stream=1)
+{
+    dest.create(src.size(), src.type());
+    const float fper = (float) per;
+#pragma omp parallel
+    {
+        std::vector<float> a(2*src.cols);
+#pragma omp for
+        for(int j=0;j<src.rows;j++)
+        {
+            const uchar* s=src.ptr(j);
+            uchar* d=dest.ptr(j);
+            noiseUniform(noiseRowKey(seed, stream, j), &a[0], 2*src.cols);
+            for(int i=0;i<src.cols;i++)
+            {
+                const float a1 = a[2*i];
+                const float a2 = a[2*i+1];
+                d[i] = (a1>fper) ? s[i] : ((a2>0.5f) ? 0 : 255);
+            }
+        }
+    }
+}
+
+// additive Gaussian noise of standard deviation sigma (rounded to integer, as
+// for randn() into CV_16S) with saturation
+
+inline void addNoiseMono(cv::Mat& src, cv::Mat& dest, double sigma,
+                         uint64 seed=NOISE_DEFAULT_SEED, unsigned int stream=0)
+{
+    dest.create(src.size(), src.type());
+    const float fsigma = (float) sigma;
+#pragma omp parallel
+    {
+        std::vector<float> z(src.cols);
+#pragma omp for
+        for(int j=0;j<src.rows;j++)
+        {
+            const uchar* s=src.ptr(j);
+            uchar* d=dest.ptr(j);
+            noiseNormal(noiseRowKey(seed, stream, j), &z[0], src.cols);
+            for(int i=0;i<src.cols;i++)
+                d[i] = cv::saturate_cast<uchar>(s[i] + cvRound(fsigma*z[i]));
+        }
+    }
+}
+
+// Gaussian (+ optional salt & pepper) noise for 1 or more channel images -
+// each channel uses its own streams of the generator
+
+inline void addNoise(cv::Mat& src, cv::Mat& dest, double sigma, double sprate=0.0,
+                     uint64 seed=NOISE_DEFAULT_SEED)
+{
+    if(src.channels()==1)
+    {
+        addNoiseMono(src,dest,sigma,seed,0);
+        if(sprate!=0)addNoiseSoltPepperMono(dest,dest,sprate,seed,1);
+        return;
+    }
+    else
+    {
+        std::vector<cv::Mat> s;
+        std::vector<cv::Mat> d(src.channels());
+        cv::split(src,s);
+        for(int i=0;i<src.channels();i++)
+        {
+            addNoiseMono(s[i],d[i],sigma,seed,2*i);
+            if(sprate!=0)addNoiseSoltPepperMono(d[i],d[i],sprate,seed,2*i+1);
+        }
+        cv::merge(d,dest);
+    }
+}
+
+/******************************************************************************/
+
+#endif
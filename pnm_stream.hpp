@@ -0,0 +1,215 @@
+// Streaming (row by row) reader / writer for binary PNM images (PGM "P5" and
+// PPM "P6", 8 or 16-bit) - lets images far larger than memory be processed in
+// bands, as only the rows currently requested are ever held in memory.
+
+// Rows are exchanged as cv::Mat of type CV_8UC1 / CV_16UC1 (PGM) or CV_8UC3 /
+// CV_16UC3 (PPM, in OpenCV BGR channel order - converted from / to the RGB
+// order of the file). 16-bit files (maxval > 255) hold big endian samples,
+// which are returned unscaled (i.e. in the range 0 - maxval).
+
+// Author : Toby Breckon, toby.breckon@durham.ac.uk
+
+// Copyright (c) 2016 School of Engineering & Computing Sciences, Durham University
+// License : LGPL - http://www.gnu.org/licenses/lgpl.html
+
+#ifndef PNM_STREAM_HPP
+#define PNM_STREAM_HPP
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <cstdio>       // includes fopen(), fread(), fwrite()
+#include <cctype>       // includes isspace()
+#include <string>		// standard C++ strings
+#include <iostream>		// standard C++ I/O (progress)
+
+/******************************************************************************/
+
+// convert n 16-bit samples between file (big endian) and host byte order
+
+inline void pnmSwapBytes(ushort* p, int n)
+{
+    const ushort one = 1;
+    if(*(const uchar*) &one==0) return;        // big endian host
+    for(int i=0;i<n;i++) p[i] = (ushort) ((p[i]>>8) | (p[i]<<8));
+}
+
+/******************************************************************************/
+
+class PNMReader
+{
+public:
+    PNMReader() : file(NULL), width(0), height(0), channels(0), depth(CV_8U), maxval(0), next(0) {}
+    ~PNMReader() { close(); }
+
+    // open a P5 / P6 file and parse its header (false on failure)
+
+    bool open(const std::string& filename)
+    {
+        close();
+        file = fopen(filename.c_str(), "rb");
+        if(!file) return false;
+
+        int magic0 = fgetc(file), magic1 = fgetc(file);
+        if((magic0!='P') || ((magic1!='5') && (magic1!='6'))
+           || !readHeaderInt(width) || !readHeaderInt(height) || !readHeaderInt(maxval)
+           || (width<=0) || (height<=0) || (maxval<=0) || (maxval>65535))
+        {
+            close();
+            return false;
+        }
+        channels = (magic1=='6') ? 3 : 1;
+        depth = (maxval>255) ? CV_16U : CV_8U;
+        next = 0;
+        return true;
+    }
+
+    void close()
+    {
+        if(file) fclose(file);
+        file = NULL;
+    }
+
+    bool isOpened() const { return file!=NULL; }
+    int rows() const { return height; }
+    int cols() const { return width; }
+    int type() const { return CV_MAKETYPE(depth, channels); }
+    int maxValue() const { return maxval; }
+
+    // read the next n rows of the image into dest (n x cols(), type())
+
+    bool read(cv::Mat& dest, int n)
+    {
+        if(!file || (next+n>height)) return false;
+        dest.create(n, width, type());
+        for(int j=0;j<n;j++)
+        {
+            if(fread(dest.ptr(j), (size_t) width*dest.elemSize(), 1, file)!=1) return false;
+            if(depth==CV_16U) pnmSwapBytes(dest.ptr<ushort>(j), width*channels);
+        }
+        if(channels==3) cv::cvtColor(dest, dest, cv::COLOR_RGB2BGR);
+        next += n;
+        return true;
+    }
+
+private:
+
+    // next header integer - skipping white space and # comments, and consuming
+    // the single white space character that follows it
+
+    bool readHeaderInt(int& value)
+    {
+        int c = fgetc(file);
+        while((c!=EOF) && (isspace(c) || (c=='#')))
+        {
+            if(c=='#') while((c!=EOF) && (c!='\n')) c = fgetc(file);
+            c = fgetc(file);
+        }
+        if((c==EOF) || !isdigit(c)) return false;
+        value = 0;
+        while((c!=EOF) && isdigit(c))
+        {
+            value = 10*value + (c-'0');
+            c = fgetc(file);
+        }
+        return (c!=EOF) && isspace(c);
+    }
+
+    FILE* file;
+    int width, height, channels;
+    int depth;              // CV_8U or CV_16U
+    int maxval;             // largest sample value (from the header)
+    int next;               // index of the next row to read
+
+    PNMReader(const PNMReader&);
+    PNMReader& operator=(const PNMReader&);
+};
+
+/******************************************************************************/
+
+class PNMWriter
+{
+public:
+    PNMWriter() : file(NULL), width(0), channels(0), depth(CV_8U), written(0) {}
+    ~PNMWriter() { close(); }
+
+    // create the file and write the header for a rows x cols image of type
+    // CV_8UC1 / CV_16UC1 (written as P5) or CV_8UC3 / CV_16UC3 (written as P6)
+    // with the given maxval (0 = 255 / 65535)
+
+    bool open(const std::string& filename, int rows, int cols, int type, int maxval=0)
+    {
+        close();
+        if((type!=CV_8UC1) && (type!=CV_8UC3) && (type!=CV_16UC1) && (type!=CV_16UC3)) return false;
+        file = fopen(filename.c_str(), "wb");
+        if(!file) return false;
+        width = cols;
+        channels = CV_MAT_CN(type);
+        depth = CV_MAT_DEPTH(type);
+        written = 0;
+        if(maxval<=0) maxval = (depth==CV_16U) ? 65535 : 255;
+        fprintf(file, "P%d\n%d %d\n%d\n", (channels==3) ? 6 : 5, cols, rows, maxval);
+        return true;
+    }
+
+    void close()
+    {
+        if(file) fclose(file);
+        file = NULL;
+    }
+
+    bool isOpened() const { return file!=NULL; }
+    int rowsWritten() const { return written; }
+
+    // append the rows of src (n x cols, same type as given to open())
+
+    bool write(const cv::Mat& src)
+    {
+        if(!file || (src.cols!=width) || (src.channels()!=channels) || (src.depth()!=depth)) return false;
+        if(channels==3) cv::cvtColor(src, rgb, cv::COLOR_BGR2RGB);
+        else if(depth==CV_16U) src.copyTo(rgb);
+        const cv::Mat& rows = ((channels==3) || (depth==CV_16U)) ? rgb : src;
+        for(int j=0;j<rows.rows;j++)
+        {
+            if(depth==CV_16U) pnmSwapBytes(rgb.ptr<ushort>(j), width*channels);
+            if(fwrite(rows.ptr(j), (size_t) width*rows.elemSize(), 1, file)!=1) return false;
+        }
+        written += rows.rows;
+        return true;
+    }
+
+private:
+    FILE* file;
+    int width, channels;
+    int depth;              // CV_8U or CV_16U
+    int written;            // number of rows written so far
+    cv::Mat rgb;            // channel / byte swapped rows (reused)
+
+    PNMWriter(const PNMWriter&);
+    PNMWriter& operator=(const PNMWriter&);
+};
+
+/******************************************************************************/
+
+// row sink (for the streaming filters) that forwards each band to a PNMWriter
+// and reports progress on std::cout; ok is false once a write has failed
+
+class PNMProgressSink
+{
+public:
+    PNMProgressSink(PNMWriter& writer, int rows) : out(writer), total(rows), ok(true) {}
+
+    void write(const cv::Mat& band)
+    {
+        ok = ok && out.write(band);
+        std::cout << "\rrows " << out.rowsWritten() << " / " << total << std::flush;
+    }
+
+    PNMWriter& out;
+    int total;
+    bool ok;
+};
+
+/******************************************************************************/
+
+#endif